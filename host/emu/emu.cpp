@@ -0,0 +1,621 @@
+// Adapter emulator
+//   The firmware (main.c) is built for the host against emu/xc.h and runs
+//   unchanged. Every register access that depends on the outside world
+//   calls into this file, which moves the serial link to a pseudo terminal
+//   and the GPIB bus to a set of simulated instruments.
+//
+//   gpib_emu [-l link] [-v] [pad[,sad]:model[:latency_ms] ...]
+//     -l link      also make link a symlink to the pty, e.g. /tmp/gpib
+//     -v           trace messages received by the instruments on stderr
+//     model        dmm, echo or scope, default 1:dmm 2:echo 3:scope
+
+#include "xc.h"
+
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+extern "C" {
+void isr_low(void);
+void firmware_main(void);
+
+volatile emu_la_t emu_lata;
+volatile emu_lb_t emu_latb;
+volatile emu_lc_t emu_latc;
+volatile emu_ld_t emu_latd;
+volatile emu_le_t emu_late;
+volatile emu_a_t emu_trisa = { 0xFF };
+volatile emu_b_t emu_trisb = { 0xFF };
+volatile emu_c_t emu_trisc = { 0xFF };
+volatile emu_d_t emu_trisd = { 0xFF };
+volatile emu_e_t emu_trise = { 0xFF };
+volatile emu_pie1_t emu_pie1;
+volatile emu_ipr1_t emu_ipr1;
+volatile emu_intcon2_t emu_intcon2;
+volatile emu_rcon_t emu_rcon;
+volatile emu_t0con_t emu_t0con;
+volatile emu_t1con_t emu_t1con;
+volatile emu_rcsta_t emu_rcsta;
+volatile emu_baudcon_t emu_baudcon;
+volatile emu_osccon_t emu_osccon;
+volatile uint8_t ANSELA, ANSELB, ANSELC, ANSELD, ANSELE;
+volatile uint8_t SPBRG1, SPBRGH1, TMR0H, IOCC;
+}
+
+namespace {
+
+// GPIB lines on port A, low = asserted
+enum { REN = 0x01, EOI = 0x02, DAV = 0x04, NRFD = 0x08, NDAC = 0x10, ATN = 0x20 };
+// and on port E
+enum { SRQ = 0x01, IFC = 0x02 };
+
+double now()
+{
+    using namespace std::chrono;
+    static auto t0 = steady_clock::now();
+    return duration<double>(steady_clock::now() - t0).count();
+}
+
+bool verbose = false;
+
+// - Simulated instrument
+struct Device {
+    int pad = 0;
+    int sad = -1;               // Secondary address, -1 = none
+    std::string model;
+    double latency = 0;         // Seconds from query to reply
+
+    bool listen = false, talk = false;
+    bool lpend = false, tpend = false;  // Primary seen, waiting for sad
+    bool accepted = false;      // Acceptor holds a byte until DAV goes high
+    enum { S_IDLE, S_NRFD, S_NDAC } source = S_IDLE;
+    uint8_t low = 0;            // Port A lines pulled low
+    uint8_t dio = 0;            // Data lines pulled low
+    bool srq = false;
+
+    std::string in, out;
+    size_t pos = 0;             // Next byte of out
+    double ready = 0;           // out is valid from this time
+    uint8_t status = 0;         // Serial poll status byte
+    double srq_at = -1;         // Pending service request
+
+    int points = 2500;          // scope: samples per curve
+    double value = 1.0;         // dmm: reading random walk
+
+    void clear()
+    {
+        in.clear();
+        out.clear();
+        pos = 0;
+        status = 0;
+        srq = false;
+        srq_at = -1;
+    }
+
+    void unaddress()
+    {
+        listen = talk = lpend = tpend = false;
+    }
+
+    void command(uint8_t c, bool &spoll);
+    void message();
+    std::string reply(std::string const &unit);
+    void step(uint8_t a, uint8_t e, uint8_t data, bool spoll);
+};
+
+std::vector<Device> devices;
+bool spoll = false;             // SPE seen, talkers send their status byte
+
+std::string upper(std::string s)
+{
+    for(char &c : s) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    return s;
+}
+
+std::string trim(std::string const &s)
+{
+    size_t b = s.find_first_not_of(" \t\r\n");
+    if(b == std::string::npos) return std::string();
+    return s.substr(b, s.find_last_not_of(" \t\r\n") - b + 1);
+}
+
+void Device::command(uint8_t c, bool &sp)
+{
+    if(c >= 0x20 && c <= 0x3E) {            // LAD
+        if(c - 0x20 == pad) {
+            listen = sad < 0;
+            lpend = sad >= 0;
+        }
+        return;
+    }
+    if(c >= 0x40 && c <= 0x5E) {            // TAD, other talkers untalk
+        talk = sad < 0 && c - 0x40 == pad;
+        tpend = sad >= 0 && c - 0x40 == pad;
+        return;
+    }
+    if(c >= 0x60 && c <= 0x7E) {            // SAD for the last primary
+        if(lpend) listen = c - 0x60 == sad;
+        if(tpend) talk = c - 0x60 == sad;
+        lpend = tpend = false;
+        return;
+    }
+    lpend = tpend = false;
+    switch(c) {
+        case 0x3F: listen = false; break;   // UNL
+        case 0x5F: talk = false; break;     // UNT
+        case 0x18: sp = true; break;        // SPE
+        case 0x19: sp = false; break;       // SPD
+        case 0x14: clear(); break;          // DCL
+        case 0x04: if(listen) clear(); break;   // SDC
+    }
+}
+
+std::string Device::reply(std::string const &unit)
+{
+    std::string u = upper(unit);
+    std::string head = u.substr(0, u.find(' '));
+    if(head == "*IDN?") {
+        char b[64];
+        std::snprintf(b, sizeof(b), "EMU,%s,%d,1.0", upper(model).c_str(), pad);
+        return b;
+    }
+    if(head == "*OPC?") return "1";
+    if(head == "*STB?") return std::to_string(status);
+    if(head == "*RST" || head == "*CLS") {
+        status = 0;
+        return std::string();
+    }
+    if(head == "*OPC") {                    // Request service when done
+        srq_at = now() + latency;
+        return std::string();
+    }
+    if(model == "scope") {
+        if(head == "DAT:POIN" || head == "DATA:POINTS") {
+            points = std::atoi(u.c_str() + head.size());
+            if(points < 1) points = 1;
+            if(points > 100000) points = 100000;
+            return std::string();
+        }
+        if(head == "CURV?" || head == "CURVE?") {
+            std::string n = std::to_string(points);
+            std::string r = "#" + std::to_string(n.size()) + n;
+            for(int i = 0; i < points; ++i)
+                r += static_cast<char>(128 + std::lround(100 * std::sin(i * 6.2832 / 500)));
+            return r;
+        }
+    }
+    if(model == "dmm" && head.find('?') != std::string::npos) {
+        value += (std::rand() % 201 - 100) * 1e-6;
+        char b[32];
+        std::snprintf(b, sizeof(b), "%+.6E", value);
+        return b;
+    }
+    return std::string();
+}
+
+void Device::message()
+{
+    std::string m = trim(in);
+    in.clear();
+    if(verbose) std::fprintf(stderr, "emu: %d <- %s\n", pad, m.c_str());
+    std::string r;
+    if(model == "echo") {
+        r = m;
+    } else {
+        // - ';' separated units, queries answered in order
+        size_t b = 0;
+        bool quote = false;
+        for(size_t i = 0; i <= m.size(); ++i) {
+            if(i < m.size() && m[i] == '"') quote = !quote;
+            if(i == m.size() || (m[i] == ';' && !quote)) {
+                std::string u = trim(m.substr(b, i - b));
+                b = i + 1;
+                if(u.empty()) continue;
+                bool query = u.substr(0, u.find(' ')).find('?') != std::string::npos;
+                std::string v = reply(u);
+                if(query) r += (r.empty() ? "" : ";") + v;
+            }
+        }
+    }
+    if(r.empty()) return;
+    out = r + "\n";
+    pos = 0;
+    ready = now() + latency;
+}
+
+void Device::step(uint8_t a, uint8_t e, uint8_t data, bool sp)
+{
+    bool atn = !(a & ATN);
+
+    if(!(e & IFC)) {
+        unaddress();
+        accepted = false;
+    }
+    if(srq_at >= 0 && now() >= srq_at) {
+        srq_at = -1;
+        status |= 0x40;
+        srq = true;
+    }
+
+    // - Acceptor: every device takes commands, listeners take data
+    uint8_t l = 0;
+    if(atn || listen) {
+        if(!accepted && !(a & DAV)) {
+            accepted = true;
+            if(atn) {
+                command(data, spoll);
+            } else {
+                in += static_cast<char>(data);
+                if(!(a & EOI) || data == '\n') message();
+                if(in.size() > 65536) in.clear();
+            }
+        } else if(accepted && (a & DAV)) {
+            accepted = false;
+        }
+        l |= accepted ? NRFD : NDAC;
+    } else {
+        accepted = false;
+    }
+
+    // - Source
+    bool have = sp ? true : pos < out.size() && now() >= ready;
+    if(!talk || atn || !have) {
+        source = S_IDLE;
+        dio = 0;
+    } else {
+        uint8_t b = sp ? status : static_cast<uint8_t>(out[pos]);
+        bool last = !sp && pos + 1 == out.size();
+        switch(source) {
+            case S_IDLE:
+                dio = b;
+                source = S_NRFD;
+                // Fall through
+            case S_NRFD:
+                if(!(a & NRFD)) break;
+                source = S_NDAC;
+                // Fall through
+            case S_NDAC:
+                if(!(a & NDAC)) {
+                    l |= DAV;
+                    if(last) l |= EOI;
+                    break;
+                }
+                if(sp) {
+                    status &= ~0x40;
+                    srq = false;
+                } else if(++pos == out.size()) {
+                    out.clear();
+                    pos = 0;
+                }
+                source = S_IDLE;
+                dio = 0;
+                break;
+        }
+    }
+    low = l;
+}
+
+// - Serial link
+int master = -1, slave = -1;
+std::string rx;                 // Host bytes not yet given to the UART
+size_t rx_pos = 0;
+double rx_next = 0;             // Earliest time for the next rx byte
+uint8_t rcreg;
+std::string tx;                 // UART output not yet written to the pty
+double tx_done = 0;             // Tx shift register busy until
+bool tx_pending = false;
+uint8_t txreg;
+double last_poll = 0;
+double idle_since = 0;
+bool in_isr = false;
+
+volatile emu_a_t porta;
+volatile emu_b_t portb;
+volatile emu_c_t portc;
+volatile emu_e_t porte;
+volatile emu_intcon_t intcon;
+volatile emu_pir1_t pir1;
+volatile emu_txsta_t txsta;
+volatile uint8_t tmr0l;
+double t0_reload = 0, t0_overflow = -1;
+bool t0_pending = false;
+volatile uint8_t tmr1l, tmr1h;
+uint64_t t1_wraps = 0;
+
+uint64_t timer1()
+{
+    double clk = (emu_t1con.TMR1CS ? 48e6 : 12e6) / (1 << emu_t1con.T1CKPS);
+    return static_cast<uint64_t>(now() * clk);
+}
+
+double byte_time()
+{
+    // 16 bit divisor with BRG16, Fosc / 4, 16 or 64 per bit
+    unsigned n = emu_baudcon.BRG16 ? SPBRG1 | SPBRGH1 << 8 : SPBRG1;
+    double clk = 48e6 / (emu_baudcon.BRG16 ? (txsta.BRGH ? 4 : 16) : (txsta.BRGH ? 16 : 64));
+    return 10 / (clk / (n + 1));
+}
+
+void flush_tx()
+{
+    size_t off = 0;
+    while(off < tx.size()) {
+        ssize_t n = write(master, tx.data() + off, tx.size() - off);
+        if(n > 0) {
+            off += static_cast<size_t>(n);
+        } else {
+            struct pollfd p = { master, POLLOUT, 0 };
+            poll(&p, 1, 10);
+        }
+    }
+    tx.clear();
+}
+
+// - Recompute the bus levels and let the instruments react
+uint8_t bus_a = 0xFF, bus_e = 0xFF, bus_b = 0xFF;
+
+void bus()
+{
+    uint8_t ca = static_cast<uint8_t>(~emu_trisa.b & ~emu_lata.b & 0x3F);
+    uint8_t ce = static_cast<uint8_t>(~emu_trise.b & ~emu_late.b & 0x03);
+    uint8_t cb = static_cast<uint8_t>(~emu_trisb.b & ~emu_latb.b);
+    for(int pass = 0; pass < 4; ++pass) {
+        uint8_t da = 0, de = 0, db = 0;
+        for(Device const &d : devices) {
+            da |= d.low;
+            db |= d.dio;
+            if(d.srq) de |= SRQ;
+        }
+        uint8_t a = static_cast<uint8_t>(~(ca | da)), e = static_cast<uint8_t>(~(ce | de));
+        uint8_t b = static_cast<uint8_t>(~(cb | db));
+        if(pass && a == bus_a && e == bus_e && b == bus_b) break;
+        if(a != bus_a || e != bus_e || b != bus_b) idle_since = now();
+        bus_a = a;
+        bus_e = e;
+        bus_b = b;
+        for(Device &d : devices) d.step(a, e, static_cast<uint8_t>(~b), spoll);
+    }
+}
+
+void tick()
+{
+    double t = now();
+
+    if(tx_pending) {
+        tx_pending = false;
+        tx += static_cast<char>(txreg);
+        tx_done = (tx_done > t ? tx_done : t) + byte_time();
+        idle_since = t;
+    }
+    if(tx.size() >= 256 || (!tx.empty() && t >= tx_done)) flush_tx();
+
+    if(rx_pos == rx.size() && t - last_poll > 20e-6) {
+        last_poll = t;
+        char b[256];
+        ssize_t n = read(master, b, sizeof(b));
+        if(n > 0) {
+            rx.assign(b, static_cast<size_t>(n));
+            rx_pos = 0;
+            idle_since = t;
+        }
+    }
+    // RTS held high by the firmware stops the host
+    if(!pir1.RCIF && rx_pos < rx.size() && t >= rx_next && !emu_latc.LC0) {
+        rcreg = static_cast<uint8_t>(rx[rx_pos++]);
+        pir1.RCIF = 1;
+        rx_next = (rx_next > t ? rx_next : t) + byte_time();
+    }
+    if(emu_t1con.TMR1ON && timer1() >> 16 != t1_wraps) {
+        t1_wraps = timer1() >> 16;
+        pir1.TMR1IF = 1;
+    }
+    if(((pir1.RCIF && emu_pie1.RCIE) || (pir1.TMR1IF && emu_pie1.TMR1IE)) &&
+       intcon.PEIE && intcon.GIE && !in_isr) {
+        in_isr = true;
+        isr_low();              // No ATN changes without a controller
+        in_isr = false;
+    }
+
+    bus();
+
+    if(t - idle_since > 2e-3 && rx_pos == rx.size() && tx.empty()) {
+        struct pollfd p = { master, POLLIN, 0 };
+        poll(&p, 1, 1);
+    }
+}
+
+}
+
+extern "C" {
+
+volatile emu_a_t *emu_porta(void)
+{
+    tick();
+    porta.b = bus_a;
+    return &porta;
+}
+
+volatile emu_b_t *emu_portb(void)
+{
+    tick();
+    portb.b = bus_b;
+    return &portb;
+}
+
+volatile emu_c_t *emu_portc(void)
+{
+    tick();
+    portc.b = emu_latc.b;
+    return &portc;
+}
+
+volatile emu_e_t *emu_porte(void)
+{
+    tick();
+    porte.b = bus_e;
+    return &porte;
+}
+
+volatile emu_intcon_t *emu_intcon(void)
+{
+    tick();
+    if(t0_pending) {
+        // 16 bit, prescaled Fosc / 4
+        double period = (emu_t0con.PSA ? 1 : 2 << emu_t0con.T0PS) / 12e6;
+        t0_pending = false;
+        t0_overflow = t0_reload + (65536 - (TMR0H << 8 | tmr0l)) * period;
+    }
+    if(emu_t0con.TMR0ON && t0_overflow >= 0 && now() >= t0_overflow) {
+        double period = (emu_t0con.PSA ? 1 : 2 << emu_t0con.T0PS) / 12e6;
+        intcon.TMR0IF = 1;
+        t0_overflow += 65536 * period;
+    }
+    return &intcon;
+}
+
+volatile emu_pir1_t *emu_pir1(void)
+{
+    tick();
+    pir1.TXIF = !tx_pending && now() >= tx_done;
+    return &pir1;
+}
+
+volatile emu_txsta_t *emu_txsta(void)
+{
+    tick();
+    txsta.TRMT = !tx_pending && now() >= tx_done;
+    return &txsta;
+}
+
+volatile uint8_t *emu_tmr0l(void)
+{
+    t0_reload = now();
+    t0_pending = true;
+    return &tmr0l;
+}
+
+volatile uint8_t *emu_tmr1l(void)
+{
+    tick();
+    uint64_t t = timer1();
+    tmr1l = static_cast<uint8_t>(t);
+    tmr1h = static_cast<uint8_t>(t >> 8);  // 16 bit read mode latch
+    return &tmr1l;
+}
+
+volatile uint8_t *emu_tmr1h(void)
+{
+    return &tmr1h;
+}
+
+volatile uint8_t *emu_txreg(void)
+{
+    tick();
+    tx_pending = true;
+    return &txreg;
+}
+
+uint8_t emu_rcreg(void)
+{
+    pir1.RCIF = 0;
+    return rcreg;
+}
+
+}
+
+namespace {
+char **args;
+}
+
+extern "C" void emu_reset(void)
+{
+    // - Restart the process on the same pty so the firmware starts clean
+    flush_tx();
+    std::vector<char *> v;
+    v.push_back(args[0]);
+    char fd[32];
+    std::snprintf(fd, sizeof(fd), "--pty=%d,%d", master, slave);
+    v.push_back(fd);
+    for(char **a = args + 1; *a; ++a)
+        if(std::strncmp(*a, "--pty=", 6)) v.push_back(*a);
+    v.push_back(nullptr);
+    execv("/proc/self/exe", v.data());
+    std::perror("gpib_emu: restart");
+    std::exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    args = argv;
+    char const *link = nullptr;
+    for(int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if(a == "-v") {
+            verbose = true;
+        } else if(a == "-l" && i + 1 < argc) {
+            link = argv[++i];
+        } else if(!a.compare(0, 6, "--pty=")) {
+            std::sscanf(a.c_str() + 6, "%d,%d", &master, &slave);
+        } else {
+            Device d;
+            char model[16] = "";
+            double ms = 0;
+            int n = 0;
+            if(std::sscanf(a.c_str(), "%d,%d:%15[a-z]%n", &d.pad, &d.sad, model, &n) < 3) {
+                d.sad = -1;
+                if(std::sscanf(a.c_str(), "%d:%15[a-z]%n", &d.pad, model, &n) < 2) {
+                    std::fprintf(stderr, "usage: gpib_emu [-l link] [-v] [pad[,sad]:model[:latency_ms] ...]\n");
+                    return 2;
+                }
+            }
+            if(a[n] == ':') ms = std::atof(a.c_str() + n + 1);
+            d.model = model;
+            d.latency = ms / 1000;
+            devices.push_back(d);
+        }
+    }
+    if(devices.empty()) {
+        char const *def[] = { "dmm", "echo", "scope" };
+        for(int i = 0; i < 3; ++i) {
+            Device d;
+            d.pad = i + 1;
+            d.model = def[i];
+            devices.push_back(d);
+        }
+    }
+
+    if(master < 0) {
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+        if(master < 0 || grantpt(master) || unlockpt(master)) {
+            std::perror("gpib_emu: pty");
+            return 1;
+        }
+        // Keep the slave open so the pty survives clients coming and going
+        slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+        struct termios t;
+        tcgetattr(slave, &t);
+        cfmakeraw(&t);
+        tcsetattr(slave, TCSANOW, &t);
+        std::printf("gpib_emu: adapter on %s\n", ptsname(master));
+        if(link) {
+            unlink(link);
+            if(symlink(ptsname(master), link)) std::perror("gpib_emu: link");
+            else std::printf("gpib_emu: linked to %s\n", link);
+        }
+        std::fflush(stdout);
+    }
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+    firmware_main();
+    return 0;
+}
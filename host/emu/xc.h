@@ -0,0 +1,150 @@
+/*
+ Host stand-in for <xc.h> used to build the firmware into the emulator
+ Plain registers are variables. Registers whose value depends on the bus,
+   the serial link or time are read through functions in emu.cpp.
+*/
+
+#ifndef EMU_XC_H
+#define EMU_XC_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define EMU_BITS(p) struct { unsigned p##0:1, p##1:1, p##2:1, p##3:1, p##4:1, p##5:1, p##6:1, p##7:1; }
+#define EMU_PORT(n, p) typedef union { uint8_t b; EMU_BITS(p); } n
+
+EMU_PORT(emu_a_t, RA);
+EMU_PORT(emu_b_t, RB);
+EMU_PORT(emu_c_t, RC);
+EMU_PORT(emu_d_t, RD);
+EMU_PORT(emu_e_t, RE);
+EMU_PORT(emu_la_t, LA);
+EMU_PORT(emu_lb_t, LB);
+EMU_PORT(emu_lc_t, LC);
+EMU_PORT(emu_ld_t, LD);
+EMU_PORT(emu_le_t, LE);
+
+typedef union { uint8_t b; struct { unsigned RBIF:1, INT0IF:1, TMR0IF:1, RBIE:1, INT0IE:1, TMR0IE:1, PEIE:1, GIE:1; };
+                struct { unsigned IOCIF:1, :2, IOCIE:1, :2, GIEL:1, GIEH:1; }; } emu_intcon_t;
+typedef union { uint8_t b; struct { unsigned IOCIP:1, :1, TMR0IP:1, :1, INTEDG2:1, INTEDG1:1, INTEDG0:1, RBPU:1; }; } emu_intcon2_t;
+typedef union { uint8_t b; struct { unsigned TMR1IF:1, TMR2IF:1, CCP1IF:1, SSPIF:1, TXIF:1, RCIF:1, ADIF:1, :1; }; } emu_pir1_t;
+typedef union { uint8_t b; struct { unsigned TMR1IE:1, TMR2IE:1, CCP1IE:1, SSPIE:1, TXIE:1, RCIE:1, ADIE:1, :1; }; } emu_pie1_t;
+typedef union { uint8_t b; struct { unsigned TMR1IP:1, TMR2IP:1, CCP1IP:1, SSPIP:1, TXIP:1, RCIP:1, ADIP:1, :1; }; } emu_ipr1_t;
+typedef union { uint8_t b; struct { unsigned BOR:1, POR:1, PD:1, TO:1, RI:1, :1, SBOREN:1, IPEN:1; }; } emu_rcon_t;
+typedef union { uint8_t b; struct { unsigned T0PS:3, PSA:1, T0SE:1, T0CS:1, T08BIT:1, TMR0ON:1; }; } emu_t0con_t;
+typedef union { uint8_t b; struct { unsigned TMR1ON:1, RD16:1, SOSCEN:1, T1SYNC:1, T1CKPS:2, TMR1CS:2; }; } emu_t1con_t;
+typedef union { uint8_t b; struct { unsigned TX9D:1, TRMT:1, BRGH:1, SENDB:1, SYNC:1, TXEN:1, TX9:1, CSRC:1; }; } emu_txsta_t;
+typedef union { uint8_t b; struct { unsigned RX9D:1, OERR:1, FERR:1, ADDEN:1, CREN:1, SREN:1, RX9:1, SPEN:1; }; } emu_rcsta_t;
+typedef union { uint8_t b; struct { unsigned ABDEN:1, WUE:1, :1, BRG16:1, CKTXP:1, DTRXP:1, RCIDL:1, ABDOVF:1; }; } emu_baudcon_t;
+typedef union { uint8_t b; struct { unsigned SCS:2, HFIOFS:1, OSTS:1, IRCF:3, IDLEN:1; }; } emu_osccon_t;
+
+extern volatile emu_la_t emu_lata;
+extern volatile emu_lb_t emu_latb;
+extern volatile emu_lc_t emu_latc;
+extern volatile emu_ld_t emu_latd;
+extern volatile emu_le_t emu_late;
+extern volatile emu_a_t emu_trisa;
+extern volatile emu_b_t emu_trisb;
+extern volatile emu_c_t emu_trisc;
+extern volatile emu_d_t emu_trisd;
+extern volatile emu_e_t emu_trise;
+extern volatile emu_pie1_t emu_pie1;
+extern volatile emu_ipr1_t emu_ipr1;
+extern volatile emu_intcon2_t emu_intcon2;
+extern volatile emu_rcon_t emu_rcon;
+extern volatile emu_t0con_t emu_t0con;
+extern volatile emu_t1con_t emu_t1con;
+extern volatile emu_rcsta_t emu_rcsta;
+extern volatile emu_baudcon_t emu_baudcon;
+extern volatile emu_osccon_t emu_osccon;
+extern volatile uint8_t ANSELA, ANSELB, ANSELC, ANSELD, ANSELE;
+extern volatile uint8_t SPBRG1, SPBRGH1, TMR0H, IOCC;
+
+volatile emu_a_t *emu_porta(void);
+volatile emu_b_t *emu_portb(void);
+volatile emu_c_t *emu_portc(void);
+volatile emu_e_t *emu_porte(void);
+volatile emu_intcon_t *emu_intcon(void);
+volatile emu_pir1_t *emu_pir1(void);
+volatile emu_txsta_t *emu_txsta(void);
+volatile uint8_t *emu_tmr0l(void);
+volatile uint8_t *emu_tmr1l(void);
+volatile uint8_t *emu_tmr1h(void);
+volatile uint8_t *emu_txreg(void);
+uint8_t emu_rcreg(void);
+void emu_reset(void);
+
+#define LATA        emu_lata.b
+#define LATB        emu_latb.b
+#define LATC        emu_latc.b
+#define LATD        emu_latd.b
+#define LATE        emu_late.b
+#define LATAbits    emu_lata
+#define LATBbits    emu_latb
+#define LATCbits    emu_latc
+#define LATDbits    emu_latd
+#define LATEbits    emu_late
+#define TRISA       emu_trisa.b
+#define TRISB       emu_trisb.b
+#define TRISC       emu_trisc.b
+#define TRISD       emu_trisd.b
+#define TRISE       emu_trise.b
+#define TRISAbits   emu_trisa
+#define TRISBbits   emu_trisb
+#define TRISCbits   emu_trisc
+#define TRISDbits   emu_trisd
+#define TRISEbits   emu_trise
+#define PORTA       (emu_porta()->b)
+#define PORTB       (emu_portb()->b)
+#define PORTC       (emu_portc()->b)
+#define PORTE       (emu_porte()->b)
+#define PORTAbits   (*emu_porta())
+#define PORTBbits   (*emu_portb())
+#define PORTCbits   (*emu_portc())
+#define PORTEbits   (*emu_porte())
+#define INTCON      (emu_intcon()->b)
+#define INTCONbits  (*emu_intcon())
+#define PIR1        (emu_pir1()->b)
+#define PIR1bits    (*emu_pir1())
+#define PIE1        emu_pie1.b
+#define PIE1bits    emu_pie1
+#define IPR1bits    emu_ipr1
+#define INTCON2bits emu_intcon2
+#define RCONbits    emu_rcon
+#define T0CON       emu_t0con.b
+#define T0CONbits   emu_t0con
+#define T1CON       emu_t1con.b
+#define T1CONbits   emu_t1con
+#define TMR0L       (*emu_tmr0l())
+#define TMR1L       (*emu_tmr1l())
+#define TMR1H       (*emu_tmr1h())
+#define TXSTA1      (emu_txsta()->b)
+#define TXSTA1bits  (*emu_txsta())
+#define RCSTA1      emu_rcsta.b
+#define RCSTA1bits  emu_rcsta
+#define BAUDCON1    emu_baudcon.b
+#define BAUDCON1bits emu_baudcon
+#define OSCCONbits  emu_osccon
+#define TXREG1      (*emu_txreg())
+#define RCREG1      (emu_rcreg())
+
+#ifndef __cplusplus
+// The C library headers the firmware uses are already in, so these
+//   XC8 keywords can be taken over
+#define __interrupt(...)
+#define __delay_us(x)   ((void)0)
+#define __delay_ms(x)   ((void)0)
+#define __asm(x)        emu_reset()     // Only used for "reset"
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
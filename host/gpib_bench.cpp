@@ -0,0 +1,78 @@
+// Throughput of the ways the client can drive the adapter
+//   gpib_bench [-n count] [-a addr] [-q query] [-r] [-b max_baud] port
+//     -n count     queries per run, default 200
+//     -a addr      device to query, default 1
+//     -q query     default READ?
+//     -r           use RTS / CTS flow control
+//     -b max_baud  negotiate a faster link up to this rate first
+//   sequential   wait for each reply before the next query
+//   pipelined    all queries on the wire, then wait for the replies
+//   batched      queries packed several to a line
+
+#include "gpib_client.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+template <class F> void run(char const *name, int n, F f)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    size_t bytes = f();
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::printf("%-12s %6d queries %8.3f s %8.1f q/s %9.0f B/s\n", name, n, s, n / s, bytes / s);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    int n = 200, addr = 1;
+    std::string q = "READ?", port;
+    gpib::Client::Options o;
+    for(int i = 1; i < argc; ++i) {
+        if(!std::strcmp(argv[i], "-n") && i + 1 < argc) n = std::atoi(argv[++i]);
+        else if(!std::strcmp(argv[i], "-a") && i + 1 < argc) addr = std::atoi(argv[++i]);
+        else if(!std::strcmp(argv[i], "-q") && i + 1 < argc) q = argv[++i];
+        else if(!std::strcmp(argv[i], "-r")) o.rtscts = true;
+        else if(!std::strcmp(argv[i], "-b") && i + 1 < argc) o.max_baud = std::atoi(argv[++i]);
+        else if(argv[i][0] != '-') port = argv[i];
+        else port.clear(), i = argc;
+    }
+    if(port.empty()) {
+        std::fprintf(stderr, "usage: gpib_bench [-n count] [-a addr] [-q query] [-r] [-b max_baud] port\n");
+        return 2;
+    }
+
+    try {
+        gpib::Client c(port, o);
+        std::printf("%s", c.command("ver").get().c_str());
+        std::printf("%u baud\n", c.baud());
+
+        run("sequential", n, [&] {
+            size_t b = 0;
+            for(int i = 0; i < n; ++i) b += c.query(addr, q).get().size();
+            return b;
+        });
+        run("pipelined", n, [&] {
+            std::vector<std::future<std::string>> f;
+            for(int i = 0; i < n; ++i) f.push_back(c.query(addr, q));
+            size_t b = 0;
+            for(auto &r : f) b += r.get().size();
+            return b;
+        });
+        run("batched", n, [&] {
+            std::vector<gpib::Client::Request> r(n, gpib::Client::Request{ addr, q, true });
+            size_t b = 0;
+            for(auto &f : c.batch(r)) b += f.get().size();
+            return b;
+        });
+    } catch(std::exception const &e) {
+        std::fprintf(stderr, "gpib_bench: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,473 @@
+#include "gpib_client.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace gpib {
+
+namespace {
+
+speed_t speed(unsigned baud)
+{
+    switch(baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 500000: return B500000;
+    case 576000: return B576000;
+    case 921600: return B921600;
+    case 1000000: return B1000000;
+    case 1500000: return B1500000;
+    case 2000000: return B2000000;
+    case 3000000: return B3000000;
+    }
+    throw Error("unsupported baud rate " + std::to_string(baud));
+}
+
+size_t const line_max = 250;    // The adapter's line buffer holds 255
+
+}
+
+Client::Client(std::string const &port, Options const &o) : opt_(o), baud_(o.baud)
+{
+    fd_ = open(port.c_str(), O_RDWR | O_NOCTTY);
+    if(fd_ < 0) throw Error(port + ": " + std::strerror(errno));
+    struct termios t;
+    tcgetattr(fd_, &t);
+    cfmakeraw(&t);
+    cfsetspeed(&t, speed(o.baud));
+    if(o.rtscts) t.c_cflag |= CRTSCTS;
+    else t.c_cflag &= ~CRTSCTS;
+    t.c_cflag |= CLOCAL | CREAD;
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    tcsetattr(fd_, TCSANOW, &t);
+
+    sync();
+    if(o.max_baud > baud_) negotiate(o.max_baud);
+    reader_ = std::thread(&Client::reader, this);
+    // Flow control first, ++compress is refused while XON/XOFF is on
+    std::string init = std::string("++mode 1;++auto 0;++eot_enable 0;++pack 0;++flow ") +
+                       (o.rtscts ? "2" : "0") + ";++compress 1;";
+    Line l;
+    l.text = init + "\r";
+    l.len = l.text.size();
+    l.ops.push_back(Op{CMD, 0, std::string(), std::promise<std::string>()});
+    auto f = l.ops.back().done.get_future();
+    send(std::move(l));
+    f.get();
+}
+
+Client::~Client()
+{
+    {
+        std::lock_guard<std::mutex> g(m_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    if(reader_.joinable()) reader_.join();
+    fail_all("client closed");
+    close(fd_);
+}
+
+void Client::sync()
+{
+    // - Stop a transfer, drop a half typed line, then have the adapter
+    //   echo a marker. Replies to an earlier client's lines come before
+    //   it and are thrown away.
+    tcflush(fd_, TCIOFLUSH);
+    std::string seen;
+    for(int i = 0; i < 10; ++i) {
+        std::string mark = "sync" + std::to_string(getpid()) + "." + std::to_string(i);
+        send_raw("\x03" + std::string(64, '\b') + "++echo 1\r++echo 0 " + mark + "\r");
+        auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+        while(std::chrono::steady_clock::now() < end) {
+            struct pollfd p = { fd_, POLLIN, 0 };
+            if(poll(&p, 1, 50) <= 0) continue;
+            char buf[256];
+            ssize_t n = ::read(fd_, buf, sizeof(buf));
+            if(n > 0) seen.append(buf, static_cast<size_t>(n));
+            if(seen.find(mark + "\r\n") != std::string::npos) return;
+            if(seen.size() > 4096) seen.erase(0, seen.size() - 256);
+        }
+    }
+    throw Error("adapter not answering");
+}
+
+void Client::set_speed(unsigned baud)
+{
+    struct termios t;
+    tcgetattr(fd_, &t);
+    cfsetspeed(&t, speed(baud));
+    tcsetattr(fd_, TCSADRAIN, &t);
+}
+
+std::string Client::read_raw(size_t n, int ms)
+{
+    // - Up to n bytes, whatever came in ms
+    std::string s;
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    while(s.size() < n && std::chrono::steady_clock::now() < end) {
+        struct pollfd p = { fd_, POLLIN, 0 };
+        if(poll(&p, 1, 10) <= 0) continue;
+        char buf[256];
+        ssize_t k = ::read(fd_, buf, std::min(sizeof(buf), n - s.size()));
+        if(k > 0) s.append(buf, static_cast<size_t>(k));
+    }
+    return s;
+}
+
+std::string Client::read_line(int ms)
+{
+    // - Text line without its CR LF, empty if none came
+    std::string s, c;
+    while((c = read_raw(1, ms)) != "\n") {
+        if(c.empty()) return std::string();
+        if(c != "\r") s += c;
+    }
+    return s;
+}
+
+// - Baud rate negotiation
+//   The reader thread is stopped meanwhile, replies are read here.
+//   See cmd_bps_test() in main.c for the adapter's side.
+
+unsigned Client::negotiate(unsigned max_baud)
+{
+    static unsigned const rates[] = { 3000000, 2000000, 1500000, 1000000, 921600, 500000, 460800 };
+    bool running = reader_.joinable();
+    drain();
+    if(running) {
+        {
+            std::lock_guard<std::mutex> g(m_);
+            stop_ = true;
+        }
+        reader_.join();
+        stop_ = false;
+    }
+    for(unsigned r : rates)
+        if(r <= max_baud && r > baud_ && try_baud(r)) break;
+    if(running) reader_ = std::thread(&Client::reader, this);
+    return baud_;
+}
+
+bool Client::try_baud(unsigned b)
+{
+    tcflush(fd_, TCIFLUSH);
+    send_raw("++bps_test " + std::to_string(b) + "\r");
+    std::string r = read_line(500);     // "rate +error%" or "err"
+    if(r.empty() || !r.compare(0, 3, "err")) return false;
+    tcdrain(fd_);
+    set_speed(b);
+    std::string pat;
+    for(int i = 0; i < 256; ++i) pat += static_cast<char>(i);
+    send_raw(pat);
+    if(read_raw(pat.size(), 500) == pat) {
+        send_raw("\x06");
+        if(read_line(500) == "ok") {
+            baud_ = b;
+            return true;
+        }
+    }
+    // The adapter goes back to the old rate once the line is quiet
+    set_speed(baud_);
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    sync();
+    return false;
+}
+
+// - Escaping
+//   Control characters go as ESC, char + 0x40 so they can't end the line
+//   or abort a transfer. A data line starting with '+' is sent with its
+//   first character escaped, the adapter then takes it as data.
+
+bool Client::batchable(std::string const &d)
+{
+    // A data segment runs to the next ";+" and can't hold a NUL
+    return !d.empty() && d[0] != '+' && d.find(";+") == std::string::npos &&
+           d.find('\0') == std::string::npos && d.back() != ';';
+}
+
+std::string Client::escape(std::string const &d, bool line_start)
+{
+    std::string r;
+    r.reserve(d.size() + 8);
+    for(size_t i = 0; i < d.size(); ++i) {
+        uint8_t c = static_cast<uint8_t>(d[i]);
+        if(c < 32) {
+            r += '\x1b';
+            r += static_cast<char>(c | 0x40);
+        } else if(c == '+' && !i && line_start) {
+            r += '\x1b';
+            r += '+';
+        } else {
+            r += static_cast<char>(c);
+        }
+    }
+    return r;
+}
+
+size_t Client::escaped_size(std::string const &d, bool line_start)
+{
+    // Bytes escape() makes of d, what the adapter has to buffer
+    size_t n = d.size();
+    for(size_t i = 0; i < d.size(); ++i)
+        if(static_cast<uint8_t>(d[i]) < 32 || (d[i] == '+' && !i && line_start)) ++n;
+    return n;
+}
+
+void Client::Builder::cmd(std::string const &c)
+{
+    std::string s = text == "++" ? c : ";++" + c;
+    text += s;
+    len += s.size();
+    ++seg;
+    data = false;
+}
+
+void Client::Builder::put(std::string const &d)
+{
+    std::string s = (data ? ";++;" : ";") + escape(d, false);
+    text += s;
+    len += s.size();
+    ++seg;
+    data = true;
+}
+
+std::string Client::Builder::finish()
+{
+    if(data) return text + ";++\r";
+    if(text.find(';') == std::string::npos) return text + ";\r";
+    return text + "\r";
+}
+
+// - Sending
+
+void Client::send_raw(std::string const &s)
+{
+    size_t off = 0;
+    while(off < s.size()) {
+        ssize_t n = ::write(fd_, s.data() + off, s.size() - off);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            throw Error(std::string("write: ") + std::strerror(errno));
+        }
+        off += static_cast<size_t>(n);
+    }
+}
+
+void Client::send(Line &&l)
+{
+    for(Op const &op : l.ops)
+        if(op.kind == READ) ++l.reads;
+    // Writing may block until the adapter catches up, which needs the
+    //   reader, so m_ is not held while writing. w_ keeps the lines on
+    //   the wire in the order of lines_.
+    std::lock_guard<std::mutex> w(w_);
+    std::string text = l.text;
+    {
+        std::unique_lock<std::mutex> g(m_);
+        // Lines behind the one being run wait in the adapter's 128 byte
+        //   receive buffer, keep them within it unless the adapter can stop us
+        if(!opt_.rtscts)
+            cv_.wait(g, [&] { return stop_ || lines_.empty() || queued_ + l.len <= opt_.window; });
+        if(stop_) throw Error("client closed");
+        if(!lines_.empty()) queued_ += l.len;
+        lines_.push_back(std::move(l));
+    }
+    send_raw(text);
+}
+
+std::vector<std::future<std::string>> Client::batch(std::vector<Request> const &r)
+{
+    std::vector<std::future<std::string>> f;
+    // Without flow control keep lines short enough for one to wait in
+    //   the adapter while the one before it runs
+    size_t max = opt_.rtscts ? line_max : std::min(line_max, opt_.window / 2);
+    Builder b;
+    Line l;
+
+    auto flush = [&] {
+        if(b.seg) {
+            l.text += b.finish();
+            l.len += b.len + 1;
+        }
+        if(!l.text.empty()) send(std::move(l));
+        b = Builder();
+        l = Line();
+    };
+
+    for(Request const &q : r) {
+        std::string a = addr_ == q.addr ? std::string() : "addr " + std::to_string(q.addr);
+        size_t wire = escaped_size(q.data, false);
+        size_t need = a.size() + wire + 16;
+        bool fits = q.data.empty() || (batchable(q.data) && need <= max);
+        if(!fits || b.len + need > max) flush();
+        if(!fits && !opt_.rtscts && escaped_size(q.data, true) > 255 + opt_.window)
+            throw Error("data too long without flow control");
+
+        if(!fits) {
+            // - Data that can't go in a batch is sent as a line of its own,
+            //   then a batch line checks the write went out and reads the
+            //   reply
+            if(!a.empty()) {
+                b.cmd(a);
+                addr_ = q.addr;
+                flush();
+            }
+            l.ops.push_back(Op{q.read ? READ : WRITE, 0, std::string(), std::promise<std::string>()});
+            f.push_back(l.ops.back().done.get_future());
+            l.text = escape(q.data, true) + "\r";
+            l.len = l.text.size();
+            b.cmd("data_err");
+            if(q.read) b.cmd("read");
+            flush();
+            continue;
+        }
+
+        // The op owns the segments from here up to the next op
+        l.ops.push_back(Op{q.read ? READ : WRITE, b.seg, std::string(), std::promise<std::string>()});
+        f.push_back(l.ops.back().done.get_future());
+        if(!a.empty()) {
+            b.cmd(a);
+            addr_ = q.addr;
+        }
+        if(!q.data.empty()) b.put(q.data);
+        if(q.read) b.cmd("read");
+    }
+    flush();
+    return f;
+}
+
+std::future<std::string> Client::write(int addr, std::string const &data)
+{
+    return std::move(batch({ Request{ addr, data, false } })[0]);
+}
+
+std::future<std::string> Client::read(int addr)
+{
+    return std::move(batch({ Request{ addr, std::string(), true } })[0]);
+}
+
+std::future<std::string> Client::query(int addr, std::string const &data)
+{
+    return std::move(batch({ Request{ addr, data, true } })[0]);
+}
+
+std::future<std::string> Client::command(std::string const &cmd)
+{
+    if(cmd.find_first_of(";\r\n") != std::string::npos)
+        throw Error("one command at a time: " + cmd);
+    if(!cmd.compare(0, 4, "addr")) addr_ = -1;
+    Line l;
+    l.text = "++" + cmd + ";\r";
+    l.len = l.text.size();
+    l.ops.push_back(Op{CMD, 1, std::string(), std::promise<std::string>()});
+    auto f = l.ops.back().done.get_future();
+    send(std::move(l));
+    return f;
+}
+
+void Client::drain()
+{
+    std::unique_lock<std::mutex> g(m_);
+    cv_.wait(g, [&] { return stop_ || lines_.empty(); });
+}
+
+// - Receiving
+
+void Client::reader()
+{
+    uint8_t buf[512];
+    for(;;) {
+        {
+            std::lock_guard<std::mutex> g(m_);
+            if(stop_) return;
+        }
+        struct pollfd p = { fd_, POLLIN, 0 };
+        if(poll(&p, 1, 50) <= 0) continue;
+        ssize_t n = ::read(fd_, buf, sizeof(buf));
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) continue;
+            fail_all("adapter gone");
+            return;
+        }
+        std::lock_guard<std::mutex> g(m_);
+        for(ssize_t i = 0; i < n; ++i) receive(buf[i]);
+    }
+}
+
+void Client::receive(uint8_t b)
+{
+    // - Called with m_ held
+    if(lines_.empty()) return;  // Nothing asked for, e.g. "SRQ"
+    Line &l = lines_.front();
+    if(l.reads) {
+        if(!rle_.feed(b, in_)) return;
+        while(l.ops[l.next].kind != READ) ++l.next;
+        l.ops[l.next++].reply.swap(in_);
+        in_.clear();
+        --l.reads;
+        return;
+    }
+    if(b != '\n') {
+        if(b != '\r') in_ += static_cast<char>(b);
+        return;
+    }
+    std::string s;
+    s.swap(in_);
+    if(s == "ok" || !s.compare(0, 3, "err")) {
+        finish(l, s);
+        lines_.pop_front();
+        if(!lines_.empty()) queued_ -= lines_.front().len;
+        cv_.notify_all();
+    } else if(l.ops.size() == 1 && l.ops[0].kind == CMD) {
+        l.ops[0].reply += s + "\n";
+    }
+}
+
+void Client::finish(Line &l, std::string const &ack)
+{
+    std::vector<int> bad;
+    std::istringstream is(ack.size() > 3 ? ack.substr(3) : std::string());
+    int n;
+    while(is >> n) bad.push_back(n);
+    for(size_t i = 0; i < l.ops.size(); ++i) {
+        Op &op = l.ops[i];
+        bool failed = false;
+        for(int s : bad) {
+            // Each op covers its segments up to where the next one starts
+            if(op.kind == CMD || (s > op.seg && (i + 1 == l.ops.size() || s <= l.ops[i + 1].seg)))
+                failed = true;
+        }
+        if(failed)
+            op.done.set_exception(std::make_exception_ptr(Error("adapter: " + ack)));
+        else
+            op.done.set_value(std::move(op.reply));
+    }
+}
+
+void Client::fail_all(std::string const &why)
+{
+    std::lock_guard<std::mutex> g(m_);
+    stop_ = true;
+    for(Line &l : lines_)
+        for(Op &op : l.ops)
+            op.done.set_exception(std::make_exception_ptr(Error(why)));
+    lines_.clear();
+    cv_.notify_all();
+}
+
+}
@@ -0,0 +1,143 @@
+// Client for the adapter's ++ protocol
+//   Requests are written to the adapter as soon as they are made and
+//   answered through futures, so several can be on the wire at once.
+//   Every request is sent as a ';' batch line, whose "ok" / "err n"
+//   summary tells which of its parts failed. Replies are read with
+//   ++compress 1, so binary replies are framed without an eot character.
+//   Requests are made from one thread at a time, the replies arrive on
+//   a reader thread of the client's own.
+//
+//     gpib::Client c("/dev/ttyACM0");
+//     auto id = c.query(5, "*IDN?");
+//     auto v = c.query(7, "READ?");
+//     std::cout << id.get() << v.get();
+
+#ifndef GPIB_CLIENT_H
+#define GPIB_CLIENT_H
+
+#include "gpib_decode.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace gpib {
+
+// A request the adapter reported as failed, e.g. a handshake timeout
+class Error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class Client {
+public:
+    struct Options {
+        unsigned baud = 230400;
+        bool rtscts = false;    // Use ++flow 2, the adapter paces the link
+        size_t window = 120;    // Bytes in flight without flow control
+        unsigned max_baud = 0;  // Then negotiate up to this rate, 0 = don't
+    };
+
+    // One part of a batch
+    struct Request {
+        int addr;
+        std::string data;       // Sent to the device unless empty
+        bool read;              // Then read its reply
+    };
+
+    explicit Client(std::string const &port, Options const &o);
+    explicit Client(std::string const &port) : Client(port, Options()) {}
+    ~Client();
+
+    Client(Client const &) = delete;
+    Client &operator=(Client const &) = delete;
+
+    std::future<std::string> write(int addr, std::string const &data);
+    std::future<std::string> read(int addr);
+    std::future<std::string> query(int addr, std::string const &data);
+
+    // Requests packed into as few lines as possible
+    std::vector<std::future<std::string>> batch(std::vector<Request> const &r);
+
+    // ++ command without the ++, returns what it printed
+    std::future<std::string> command(std::string const &cmd);
+
+    // Wait until every request so far has been answered
+    void drain();
+
+    // Move the link to the fastest rate up to max_baud that passes the
+    //   adapter's loopback test, returns the rate in use
+    unsigned negotiate(unsigned max_baud);
+    unsigned baud() const { return baud_; }
+
+private:
+    enum Kind { WRITE, READ, CMD };
+
+    struct Op {
+        Kind kind;
+        int seg;                // Segment number in the batch line, 0 = none
+        std::string reply;
+        std::promise<std::string> done;
+    };
+
+    struct Line {
+        std::string text;
+        size_t len = 0;         // Bytes the adapter has to buffer
+        std::vector<Op> ops;
+        size_t reads = 0;       // Replies still to come
+        size_t next = 0;        // Op waiting for the next reply
+    };
+
+    // Builds one batch line, see batch() in main.c
+    struct Builder {
+        std::string text = "++";
+        size_t len = 2;         // Length with the escapes, as the adapter gets it
+        int seg = 0;            // Non-empty segments so far
+        bool data = false;      // Last segment was data
+        void cmd(std::string const &c);
+        void put(std::string const &d);
+        std::string finish();
+    };
+
+    int fd_ = -1;
+    Options opt_;
+    unsigned baud_;
+    int addr_ = -1;             // Address set on the adapter, -1 = unknown
+
+    std::mutex w_;              // Held while sending a line
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::deque<Line> lines_;    // Sent, not answered yet
+    size_t queued_ = 0;         // Bytes of lines_ after the first
+    bool stop_ = false;
+    std::thread reader_;
+
+    RleDecoder rle_;
+    std::string in_;            // Current reply or text line
+
+    static bool batchable(std::string const &data);
+    static std::string escape(std::string const &data, bool line_start);
+    static size_t escaped_size(std::string const &data, bool line_start);
+
+    void sync();
+    void set_speed(unsigned baud);
+    bool try_baud(unsigned baud);
+    std::string read_raw(size_t n, int ms);
+    std::string read_line(int ms);
+    void send(Line &&l);
+    void send_raw(std::string const &s);
+    void reader();
+    void receive(uint8_t b);
+    void finish(Line &l, std::string const &ack);
+    void fail_all(std::string const &why);
+};
+
+}
+
+#endif
@@ -0,0 +1,92 @@
+#include "gpib_decode.h"
+
+#include <cstring>
+
+namespace gpib {
+
+void RleDecoder::reset()
+{
+    prev_ = 0;
+    literal_ = repeat_ = 0;
+}
+
+void RleDecoder::put(uint8_t b, std::string &out)
+{
+    if(delta_) b = prev_ = static_cast<uint8_t>(prev_ + b);
+    out += static_cast<char>(b);
+}
+
+bool RleDecoder::feed(uint8_t b, std::string &out)
+{
+    if(literal_) {
+        --literal_;
+        put(b, out);
+    } else if(repeat_) {
+        while(repeat_) {
+            --repeat_;
+            put(b, out);
+        }
+    } else if(b < 0x80) {
+        literal_ = b + 1;
+    } else if(b > 0x80) {
+        repeat_ = 257 - b;
+    } else {                    // - End of reply
+        reset();
+        return true;
+    }
+    return false;
+}
+
+void PackDecoder::reset()
+{
+    state_ = TYPE;
+    count_ = have_ = 0;
+}
+
+bool PackDecoder::feed(uint8_t b, std::vector<double> &values, std::string &text)
+{
+    switch(state_) {
+    case TYPE:
+        if(b == 0x81 || b == 0x82) {
+            type_ = b;
+            state_ = COUNT;
+            return false;
+        }
+        state_ = TEXT;          // Reply did not parse: plain text
+        // Fall through
+    case TEXT:
+        text += static_cast<char>(b);
+        if(b == '\n') {
+            reset();
+            return true;
+        }
+        return false;
+    case COUNT:
+        if(!b) {                // - Empty frame ends the reply
+            reset();
+            return true;
+        }
+        count_ = b;
+        have_ = 0;
+        state_ = VALUE;
+        return false;
+    case VALUE:
+        v_[have_++] = b;
+        if(have_ == 4) {
+            uint32_t u = v_[0] | v_[1] << 8 | v_[2] << 16 | uint32_t(v_[3]) << 24;
+            if(type_ == 0x81) {
+                float f;
+                std::memcpy(&f, &u, 4);
+                values.push_back(f);
+            } else {
+                values.push_back(static_cast<int32_t>(u));
+            }
+            have_ = 0;
+            if(!--count_) state_ = TYPE;
+        }
+        return false;
+    }
+    return false;
+}
+
+}
@@ -0,0 +1,50 @@
+// Host side decoders for the adapter's optional reply encodings
+//   ++compress 1, 2    run length (and delta) coded replies
+//   ++pack 1, 2        numeric replies sent as float32 / int32 frames
+
+#ifndef GPIB_DECODE_H
+#define GPIB_DECODE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace gpib {
+
+class RleDecoder {
+public:
+    explicit RleDecoder(bool delta = false) : delta_(delta) {}
+
+    // Decode one byte of the stream into out
+    // Returns true when the end of reply marker has been seen
+    bool feed(uint8_t b, std::string &out);
+    void reset();
+
+private:
+    bool delta_;
+    uint8_t prev_ = 0;      // Previous output byte for delta coding
+    int literal_ = 0;       // Literal bytes still to come
+    int repeat_ = 0;        // Repeat count waiting for its byte
+
+    void put(uint8_t b, std::string &out);
+};
+
+class PackDecoder {
+public:
+    // Decode one byte of a packed reply
+    // Values are appended to values, text fallback to text
+    // Returns true when the reply is complete
+    bool feed(uint8_t b, std::vector<double> &values, std::string &text);
+    void reset();
+
+private:
+    enum { TYPE, COUNT, VALUE, TEXT } state_ = TYPE;
+    uint8_t type_ = 0;
+    int count_ = 0;         // Values left in the frame
+    int have_ = 0;          // Bytes of the current value
+    uint8_t v_[4] = {};
+};
+
+}
+
+#endif
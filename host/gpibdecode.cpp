@@ -0,0 +1,52 @@
+// Decode adapter replies captured from the serial link
+//   gpibdecode [-c | -d] [-p] < capture > decoded
+//     -c   replies were sent with ++compress 1 (RLE)
+//     -d   replies were sent with ++compress 2 (delta + RLE)
+//     -p   replies were sent with ++pack, values are printed one per line
+
+#include "gpib_decode.h"
+
+#include <cstdio>
+#include <cstring>
+
+int main(int argc, char **argv)
+{
+    bool rle = false, delta = false, pack = false;
+    for(int i = 1; i < argc; ++i) {
+        if(!std::strcmp(argv[i], "-c")) {
+            rle = true;
+        } else if(!std::strcmp(argv[i], "-d")) {
+            rle = delta = true;
+        } else if(!std::strcmp(argv[i], "-p")) {
+            pack = true;
+        } else {
+            std::fprintf(stderr, "usage: gpibdecode [-c | -d] [-p] < in > out\n");
+            return 2;
+        }
+    }
+
+    gpib::RleDecoder rd(delta);
+    gpib::PackDecoder pd;
+    std::string bytes, text;
+    std::vector<double> values;
+    int c;
+    while((c = std::getchar()) != EOF) {
+        bytes.clear();
+        if(rle)
+            rd.feed(static_cast<uint8_t>(c), bytes);
+        else
+            bytes += static_cast<char>(c);
+        for(char b : bytes) {
+            if(!pack) {
+                std::putchar(b);
+                continue;
+            }
+            pd.feed(static_cast<uint8_t>(b), values, text);
+            for(double v : values) std::printf("%.9g\n", v);
+            std::fputs(text.c_str(), stdout);
+            values.clear();
+            text.clear();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,146 @@
+// Round trip of the firmware's reply compression through RleDecoder
+//   rle_test [gpib_emu]
+//   Runs the emulator with an echo device at address 2 and reads replies
+//   back with ++compress 1 and 2, with and without an eot char, checking
+//   each decodes to what was sent and that the stream stays in frame.
+//   Exit status 0 when all pass.
+
+#include "gpib_decode.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace {
+
+int fd = -1;
+
+void send(std::string const &s)
+{
+    for(size_t i = 0; i < s.size();) {
+        ssize_t n = write(fd, s.data() + i, s.size() - i);
+        if(n > 0) i += n;
+        else if(n < 0) usleep(1000);
+    }
+}
+
+// Bytes from the adapter until it has been quiet for ms
+std::string drain(int ms)
+{
+    std::string in;
+    char b[256];
+    struct pollfd p = { fd, POLLIN, 0 };
+    while(poll(&p, 1, ms) > 0) {
+        ssize_t n = read(fd, b, sizeof(b));
+        if(n <= 0) break;
+        in.append(b, n);
+    }
+    return in;
+}
+
+std::string show(std::string const &s)
+{
+    std::string r;
+    char h[8];
+    for(unsigned char c : s) {
+        if(c >= ' ' && c < 0x7F) {
+            r += c;
+        } else {
+            std::snprintf(h, sizeof(h), "\\x%02X", c);
+            r += h;
+        }
+    }
+    return r;
+}
+
+// Query the echo device with payload, decode the reply, compare
+bool check(int compress, int eot, std::string const &payload)
+{
+    send(payload + "\r++read\r");
+    std::string in = drain(300), out;
+    gpib::RleDecoder d(compress == 2);
+    size_t i = 0;
+    bool end = false;
+    while(i < in.size() && !end) end = d.feed(static_cast<uint8_t>(in[i++]), out);
+    std::string want = payload + "\n";
+    if(eot >= 0) want += static_cast<char>(eot);
+    bool ok = end && i == in.size() && out == want;
+    if(!ok) {
+        std::printf("FAIL compress %d eot %d: %s\n", compress, eot, show(payload).c_str());
+        std::printf("  got  %s%s\n", show(out).c_str(), end ? "" : " (no end)");
+        if(i < in.size()) std::printf("  left %s\n", show(in.substr(i)).c_str());
+    }
+    return ok;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    char const *emu = argc > 1 ? argv[1] : "./gpib_emu";
+    char link[64];
+    std::snprintf(link, sizeof(link), "/tmp/rle_test.%d", static_cast<int>(getpid()));
+
+    pid_t pid = fork();
+    if(!pid) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        execl(emu, emu, "-l", link, "2:echo", static_cast<char *>(nullptr));
+        std::perror(emu);
+        _exit(127);
+    }
+    for(int i = 0; i < 100 && fd < 0; ++i) {
+        usleep(20000);
+        fd = open(link, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    }
+    if(fd < 0) {
+        std::fprintf(stderr, "rle_test: no emulator on %s\n", link);
+        kill(pid, SIGTERM);
+        return 1;
+    }
+    struct termios t;
+    tcgetattr(fd, &t);
+    cfmakeraw(&t);
+    tcsetattr(fd, TCSANOW, &t);
+
+    send("++echo 0\r++mode 1\r++auto 0\r++eos 2\r++read_tmo_ms 200\r++addr 2\r");
+    drain(300);
+
+    std::string runs = "abc" + std::string(40, 'a') + std::string(130, 'b') + "cd";
+    std::string ramp;
+    for(int i = 0; i < 120; ++i) ramp += static_cast<char>('0' + i % 64);
+    std::string const payloads[] = { "x", "hello", std::string(60, 'z'), runs, ramp };
+    int const eots[] = { -1, '\n', 0x80, 0x7F };
+
+    int fail = 0, n = 0;
+    for(int c = 1; c <= 2; ++c) {
+        for(int e : eots) {
+            send("++compress " + std::to_string(c) + "\r");
+            if(e < 0)
+                send("++eot_enable 0\r");
+            else
+                send("++eot_enable 1\r++eot_char " + std::to_string(e) + "\r");
+            drain(100);
+            for(auto const &p : payloads) {
+                ++n;
+                if(!check(c, e, p)) ++fail;
+            }
+        }
+    }
+    std::printf("rle_test: %d of %d passed\n", n - fail, n);
+
+    close(fd);
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    unlink(link);
+    return fail ? 1 : 0;
+}
@@ -14,8 +14,8 @@
  RA4  NDAC       Not Data Acknowledge
  RA5  ATN        ATteNion
  RB   GPIB Data
- RC0  -
- RC1  -
+ RC0  RTS        Host may send when low (++flow 2)
+ RC1  ATN        Wired to RA5, interrupt on change in device mode
  RC2  -
  RC4  USB D-
  RC5  USB D+
@@ -59,12 +59,13 @@ enum {           // - GPIB bus commands (sent with ATN asserted)
 
 typedef struct {
     uint8_t     debug;          // Debug flags
-    uint16_t    brg;            // Baud rate generator divisor  13 -> 230400
+    uint16_t    brg;            // Baud rate generator divisor  52 -> 230400
     uint8_t     echo;           // Echo
     uint16_t    talk_timeout;   // Talk timeout
     uint16_t    spoll_timeout;  // Serial poll timeout
                                // -- Prologix
     uint8_t     addr;           // GPIB address to communicate with
+    uint8_t     sad;            // Secondary address, SAD + 0 to 30 or 0 = none
     uint8_t     auto_read;      // Automatically read after write
     uint16_t    listen_timeout; // Listen timeout
     uint8_t     eoi;            // Assert EOI at the end of data sent to the GPID device
@@ -72,16 +73,25 @@ typedef struct {
     uint8_t     eot_enable;     // Enable appending a character to data received from GPIB device
     uint8_t     eot_char;       // Char to append to data received from GPIB device
     uint8_t     status;         // Status returned by serial poll
+    uint8_t     mode;           // 1 = Controller, 0 = Device
+    uint8_t     flow;           // Host flow control 0 = off, 1 = XON/XOFF, 2 = RTS
+    uint8_t     pack;           // Send numeric replies as 0 = text, 1 = float32, 2 = int32
+    uint8_t     compress;       // Compress replies 0 = off, 1 = RLE, 2 = delta + RLE
+    uint8_t     srq_auto;       // Report SRQ to the host when it is asserted
+    uint32_t    auto_tmo;       // Addresses with learned reply timeouts, bit n = pad n
+    uint16_t    auto_tmo_min;   // Bounds for learned timeouts in ms
+    uint16_t    auto_tmo_max;
 } TCONFIG;
 
 TCONFIG config = {
     0,          // Debug flags
-    13,         // Baud rate generator divisor  13 -> 230400
+    52,         // Baud rate generator divisor  52 -> 230400
     1,          // Echo
     100,        // Talk timeout
     100,        // Serial poll timeout
                 //
     1,          // Remote address
+    0,          // Secondary address = none
     2,          // Auto mode
     100,        // Listen timeout
     1,          // eoi = on
@@ -89,17 +99,157 @@ TCONFIG config = {
     0,          // eot enable == off
     '\n',       // eot character
     0,          // serial poll status
+    1,          // mode = controller
+    0,          // flow control = off
+    0,          // pack = text
+    0,          // compress = off
+    0,          // srq_auto = off
+    0,          // auto_tmo = none
+    2,          // auto_tmo_min
+    1000,       // auto_tmo_max
 };
 
 typedef struct {
     uint16_t listen_timeout;
     uint16_t talk_timeout;
     uint16_t spoll_timeout;
+    uint16_t auto_min;
+    uint16_t auto_max;
 } TTIMEOUT;
 
 TTIMEOUT timeout = { 0 };
 
 
+#define XON  0x11
+#define XOFF 0x13
+
+typedef struct {
+    uint8_t head;           // Next free slot, written by the interrupt
+    uint8_t tail;           // Next byte to read
+    uint8_t stop;           // Host has been asked to stop sending
+    uint8_t xoff;           // XOFF waits for the tx to be free
+    uint8_t abort;          // ctrl-C received, stop the current transfer
+    uint8_t ferr;           // Framing errors in the last 256 bytes or so
+    uint8_t rx_n;           // Bytes received, wraps to start a new count
+    uint8_t buf[128];
+} TUART;
+
+volatile TUART uart = { 0 };
+
+volatile uint16_t t1_hi = 0;    // Timer 1 overflows, counted by the interrupt
+volatile uint8_t atn_n = 0;     // ATN asserts seen by the interrupt
+
+#define UART_MASK   (sizeof(uart.buf) - 1)
+#define UART_STOP   (sizeof(uart.buf) - 32) // Stop the host with room to spare
+#define UART_START  32                      // Restart when mostly drained
+
+/*
+ Interrupts
+ Two priorities: the ATN change is the only high priority source, so
+   the low priority UART and timer 1 work never delays the NDAC assert.
+   Neither waits on the UART tx: an XOFF that can't go out at once is
+   left to uart_xoff(), run ahead of the main loop's own output.
+*/
+
+void __interrupt(high_priority) isr_high(void)
+{
+    if(INTCONbits.IOCIF) {      // - ATN changed, only enabled in device mode
+        uint8_t c = PORTC;      // Reading ends the mismatch
+        INTCONbits.IOCIF = 0;
+        if(!(c & 0x02)) {       // Asserted: hold off the controller's
+            LATAbits.LA4 = 0;   //   command bytes with NDAC until the
+            ++atn_n;            //   main loop gets to them
+        }
+    }
+}
+
+void __interrupt(low_priority) isr_low(void)
+{
+    if(PIR1bits.TMR1IF) {
+        PIR1bits.TMR1IF = 0;
+        ++t1_hi;
+    }
+    if(PIR1bits.RCIF) {
+        if(RCSTA1bits.OERR) {   // Overrun: restart the receiver
+            RCSTA1bits.CREN = 0;
+            RCSTA1bits.CREN = 1;
+        }
+        if(RCSTA1bits.FERR) {   // Framing error: drop the byte
+            (void)RCREG1;
+            if(uart.ferr != 255) ++uart.ferr;
+        } else {
+            uint8_t h = (uart.head + 1) & UART_MASK;
+            uint8_t c = RCREG1;
+            if(!++uart.rx_n) uart.ferr = 0;
+            if(c == 3) uart.abort = 1;
+            if(h != uart.tail) {
+                uart.buf[uart.head] = c;
+                uart.head = h;
+            }
+            if(!uart.stop && config.flow &&
+               ((h - uart.tail) & UART_MASK) >= UART_STOP) {
+                uart.stop = 1;
+                if(config.flow == 1) {
+                    if(TXSTA1bits.TRMT)     // Only safe with tx idle
+                        TXREG1 = XOFF;
+                    else
+                        uart.xoff = 1;
+                } else {
+                    LATCbits.LC0 = 1;       // Deassert RTS
+                }
+            }
+        }
+    }
+}
+
+uint8_t uart_rx_ready(void)
+{
+    return uart.head != uart.tail;
+}
+
+char uart_peek(void)
+{
+    // - Next byte without taking it, check uart_rx_ready() first
+    return uart.buf[uart.tail];
+}
+
+char uart_getc(void)
+{
+    char c;
+    while(uart.head == uart.tail);
+    c = uart.buf[uart.tail];
+    uart.tail = (uart.tail + 1) & UART_MASK;
+    if(uart.stop && ((uart.head - uart.tail) & UART_MASK) <= UART_START) {
+        if(config.flow == 1 && uart.xoff) {
+            uart.xoff = 0;          // Never went out, nothing to undo
+        } else if(config.flow == 1) {
+            while(!PIR1bits.TXIF);  // Wait for tx reg empty
+            TXREG1 = XON;
+        }
+        uart.stop = 0;
+        LATCbits.LC0 = 0;       // Assert RTS
+    }
+    return c;
+}
+
+void uart_xoff(void)
+{
+    // - Send the XOFF the interrupt left, before any other output
+    if(!uart.xoff) return;
+    while(!PIR1bits.TXIF);  // Wait for tx reg empty
+    TXREG1 = XOFF;
+    uart.xoff = 0;
+}
+
+void uart_putc(uint8_t c)
+{
+    uart_xoff();
+    while(!PIR1bits.TXIF);  // Wait for tx reg empty
+    TXREG1 = c;
+}
+
+#define BRG_CLOCK   12000000ul      // BRG16 and BRGH, Fosc / 4
+
 void update_brg(void)
 {
     uint16_t brg = config.brg - 1;
@@ -110,6 +260,7 @@ void update_brg(void)
 void print(char const *s)
 {
     char c;
+    uart_xoff();
     while((c = *s++)) {
         while(!PIR1bits.TXIF);  // Wait for tx reg empty
         TXREG1 = c;
@@ -229,11 +380,25 @@ uint16_t us_to_tmr(uint16_t us)
     return (uint16_t)t;
 }
 
+uint32_t timer1(void)
+{
+    // - Timer 1 extended to 32 bits, 1.5 MHz
+    uint16_t hi;
+    uint8_t lo;
+    do {
+        hi = t1_hi;
+        lo = TMR1L;             // Latches TMR1H
+    } while(hi != t1_hi || PIR1bits.TMR1IF);
+    return (uint32_t)hi << 16 | (uint16_t)TMR1H << 8 | lo;
+}
+
 void update_timers(void)
 {
     timeout.listen_timeout = ms_to_tmr(config.listen_timeout);
     timeout.talk_timeout = ms_to_tmr(config.talk_timeout);
     timeout.spoll_timeout = ms_to_tmr(config.spoll_timeout);
+    timeout.auto_min = ms_to_tmr(config.auto_tmo_min);
+    timeout.auto_max = ms_to_tmr(config.auto_tmo_max);
 }
 
 void gpib_system(uint8_t m)
@@ -246,240 +411,1318 @@ void gpib_system(uint8_t m)
         TRISAbits.RA0 = 0;  // REN as output
         TRISEbits.RE1 = 0;  // IFC as output
     } else {
-        /// todo
+                            // - Be a device
+        TRISAbits.RA0 = 1;  // REN as input
+        TRISEbits.RE1 = 1;  // IFC as input
+        LATDbits.LD6 = 0;   // SC System control
     }
 }
 
-void gpib_talk(uint8_t c)
+enum {                  // - What the last addressing left on the bus
+    BUS_UNKNOWN = 0,    // Anything, re-address everything
+    BUS_LISTEN,         // bus.pad, bus.sad listening, we talk
+    BUS_TALK            // bus.pad, bus.sad talking, we listen
+};
+
+typedef struct {
+    uint8_t state;
+    uint8_t pad;
+    uint8_t sad;
+    uint8_t role;           // Port and transceiver setup, ROLE_xxx
+} TBUS;
+
+TBUS bus = { 0 };
+
+enum {                  // - Port and transceiver setups
+    ROLE_NONE = 0,      // Not known, e.g. at power up
+    ROLE_LISTEN,        // Controller, listening or idle
+    ROLE_CMD,           // Controller talking with ATN
+    ROLE_DATA,          // Controller talking data
+    ROLE_IDLE,          // Device, not talking
+    ROLE_TALK           // Device talking
+};
+
+typedef struct {
+    uint8_t lata, lata_m;   // Port A levels, bits to set
+    uint8_t trisa, trisa_m; // Port A directions, bits to set
+    uint8_t late, late_m;
+    uint8_t trise, trise_m;
+    uint8_t latd, latd_m;   // Transceiver controls
+    uint8_t trisb;          // Data port direction, 0 = talk
+} TROLE;
+
+TROLE const roles[] = {
+    //  ATN EOI        ATN NRFD
+    //  NDAC NRFD DAV  NDAC DAV EOI  SRQ     SRQ     TE2 DC TE  Data
+    // - Listen: NDAC, NRFD, ATN as tx; DAV, EOI, SRQ as rx
+    //   NDAC and NRFD asserted, gpib_tx() releases ATN after this when
+    //   it addressed a talker, so it waits for us. ATN is left alone.
+    { 0x00, 0x18,      0x06, 0x3E,   0, 0,   1, 1,   0x00, 0xB0, 0xFF },
+    // - Command: DAV, ATN, EOI as tx; NDAC, NRFD, SRQ as rx
+    { 0x26, 0x26,      0x18, 0x3E,   0, 0,   1, 1,   0x90, 0xB0, 0x00 },
+    // - Data: DAV, SRQ as tx; NDAC, NRFD, ATN as rx
+    //   EOI is low but left as input, its direction follows ATN
+    { 0x04, 0x06,      0x3A, 0x3E,   1, 1,   0, 1,   0xB0, 0xB0, 0x00 },
+    // - Device idle: NDAC, NRFD, SRQ as tx; DAV, ATN, EOI as rx
+    //   gpib_device_idle() sets NDAC and SRQ
+    { 0x08, 0x08,      0x26, 0x3E,   0, 0,   0, 1,   0x20, 0xB0, 0xFF },
+    // - Device talk: DAV as tx; NDAC, NRFD as rx, the rest as when idle
+    { 0x04, 0x06,      0x18, 0x1C,   0, 0,   0, 0,   0x90, 0x90, 0x00 }
+};
+
+void gpib_role(uint8_t r)
 {
-                            // Enable talk on data bus
-    LATB = 0xFF;
-    LATDbits.LD4 = 1;       // TE Talk enable
-    TRISB = 0x00;           // Switch data port to output
-    
-                            // Enable DAV as tx; NDAC, NRFD as rx
-    LATAbits.LA2 = 1;       // DAV high
-    TRISAbits.RA4 = 1;      // NDAC as input
-    TRISAbits.RA3 = 1;      // NRFD as input
-    //TRISA |= 0x18;          // NDAC, NRFD as input
-    LATDbits.LD7 = 1;       // TE2 Talk enable
-    TRISAbits.RA2 = 0;      // DAV as output
+    // - Set up the ports and transceivers for role r, if they aren't
+    //   Pins become inputs first, then levels are set, then the
+    //   transceivers turn, then pins become outputs, as the bit by bit
+    //   sequences did, so no line is driven against the bus in between
+    //   Interrupts stay on. An ATN interrupt that came while LATA was
+    //   rewritten has its NDAC set again after.
+    TROLE const *t;
+    uint8_t n = atn_n;
+    if(bus.role == r) return;
+    bus.role = r;
+    t = &roles[r - 1];
+    TRISA |= t->trisa & t->trisa_m;
+    TRISE |= t->trise & t->trise_m;
+    TRISB |= t->trisb;
+    LATA = (LATA & ~t->lata_m) | t->lata;
+    if(n != atn_n) LATAbits.LA4 = 0;
+    LATE = (LATE & ~t->late_m) | t->late;
+    if(!t->trisb) LATB = 0xFF;
+    LATD = (LATD & ~t->latd_m) | t->latd;
+    TRISA &= t->trisa | ~t->trisa_m;
+    TRISE &= t->trise | ~t->trise_m;
+    TRISB &= t->trisb;
+}
+
+/*
+ Reply compression (++compress 1 or 2)
+ PackBits style run length coding of the bytes sent to the host
+   0x00 - 0x7F  n + 1 literal bytes follow
+   0x81 - 0xFF  the next byte is repeated 257 - n times
+   0x80         end of reply
+ With ++compress 2 each byte is replaced by its difference from the
+   previous one first, so slowly changing samples become runs.
+ The eot char, when enabled, is coded as the last byte of the reply.
+ host/gpib_decode.cpp is the matching decoder.
+*/
+
+typedef struct {
+    uint8_t prev;           // Previous byte for delta coding
+    uint8_t last;           // Byte being repeated
+    uint8_t run;            // Repeat count of last
+    uint8_t n;              // Bytes in lit
+    uint8_t lit[64];
+} TRLE;
+
+TRLE rle = { 0 };
+
+void rle_lit_flush(void)
+{
+    uint8_t *p = rle.lit;
+    if(!rle.n) return;
+    uart_putc(rle.n - 1);
+    while(rle.n) {
+        uart_putc(*p++);
+        --rle.n;
+    }
+}
+
+void rle_run_flush(void)
+{
+    if(rle.run > 2) {
+        rle_lit_flush();
+        uart_putc((uint8_t)(1 - rle.run));
+        uart_putc(rle.last);
+    } else {
+        while(rle.run--) {      // Short runs are cheaper as literals
+            if(rle.n == sizeof(rle.lit)) rle_lit_flush();
+            rle.lit[rle.n++] = rle.last;
+        }
+    }
+    rle.run = 0;
+}
+
+void rle_byte(uint8_t b)
+{
+    if(config.compress == 2) {
+        uint8_t d = b - rle.prev;
+        rle.prev = b;
+        b = d;
+    }
+    if(rle.run && b == rle.last && rle.run < 128) {
+        ++rle.run;
+    } else {
+        rle_run_flush();
+        rle.last = b;
+        rle.run = 1;
+    }
+}
+
+void rle_end(void)
+{
+    rle_run_flush();
+    rle_lit_flush();
+    uart_putc(0x80);
+    rle.prev = 0;
+}
+
+void rx_put(uint8_t b)
+{
+    if(config.compress)
+        rle_byte(b);
+    else
+        uart_putc(b);
+}
+
+void rx_print(char const *s)
+{
+    while(*s) rx_put((uint8_t)*s++);
+}
+
+/*
+ Numeric reply packing (++pack 1 or 2)
+ Comma or semicolon separated numbers are sent to the host as frames of
+   0x81 (float32) or 0x82 (int32), count, count * 4 bytes little endian
+ A frame with a count of 0 ends the reply. If a field does not parse the
+   values so far are flushed and the rest of the reply is sent as text.
+   No eot char is sent after a packed reply.
+*/
+
+typedef struct {
+    uint8_t n;              // Chars in fld
+    uint8_t cnt;            // Values in val
+    uint8_t raw;            // Parse failed, pass the rest through as text
+    char fld[24];
+    uint8_t val[16 * 4];
+} TPACK;
+
+TPACK pack = { 0 };
+
+float const pack_pow10[] = { 1e1f, 1e2f, 1e4f, 1e8f, 1e16f, 1e32f };
+
+uint8_t pack_parse(char const *s, uint8_t *v)
+{
+    uint32_t m = 0;
+    int8_t e = 0;
+    int8_t x = 0;
+    uint8_t neg = 0, xneg = 0, dot = 0, digits = 0;
     
-    if(c) {                 // - If sending command then ATN must be tx
-                            // Enable ATN, EOI as tx, SRQ as rx
-        LATAbits.LA5 = 1;   // ATN high
-        LATAbits.LA1 = 1;   // EOI high
-        //LATA |= 0x22;       // ATN, EOI high
-        TRISEbits.RE0 = 1;  // SRQ as input
-        LATDbits.LD5 = 0;   // DC Direction control
-        TRISAbits.RA5 = 0;  // ATN as output
-        TRISAbits.RA1 = 0;  // EOI as output
-        //TRISA &= 0xDD;      // ATN, EOI as outputs
-    } else {                // - When sending data allow other devices to pull ATN low
-        TRISAbits.RA1 = 1;  // Set EOI to low, but leave as input
-        LATAbits.LA1 = 0;   //   because the direction is controlled by ATN
-                            // Enable SRQ as tx, ATN as rx
-        LATEbits.LE0 = 1;   // SRQ high
-        TRISAbits.RA5 = 1;  // ATN as input
-        LATDbits.LD5 = 1;   // DC Direction control
-        TRISEbits.RE0 = 0;  // SRQ as output
+    while(*s == ' ') ++s;
+    if(*s == '+' || *s == '-') neg = *s++ == '-';
+    for(;; ++s) {
+        if(*s >= '0' && *s <= '9') {
+            if(m < 100000000ul) {   // Keep 9 significant digits
+                m = m * 10 + (*s - '0');
+                if(dot) --e;
+            } else if(!dot) {
+                ++e;
+            }
+            ++digits;
+        } else if(*s == '.' && !dot) {
+            dot = 1;
+        } else {
+            break;
+        }
+    }
+    if(!digits) return 1;
+    if(*s == 'E' || *s == 'e') {
+        ++s;
+        if(*s == '+' || *s == '-') xneg = *s++ == '-';
+        if(*s < '0' || *s > '9') return 1;
+        while(*s >= '0' && *s <= '9') {
+            if(x > 9) return 1;
+            x = x * 10 + (*s++ - '0');
+        }
+        e += xneg ? -x : x;
     }
+    while(*s == ' ') ++s;
+    if(*s) return 1;
     
+    if(config.pack == 2) {      // - int32
+        if(dot || e) return 1;
+        int32_t i = neg ? -(int32_t)m : (int32_t)m;
+        memcpy(v, &i, 4);
+    } else {                    // - float32
+        if(e > 38 || e < -45) return 1;
+        float f = (float)m;
+        uint8_t u = e < 0 ? -e : e;
+        float const *p = pack_pow10;
+        for(; u; u >>= 1, ++p) {
+            if(u & 1) {
+                if(e < 0) f /= *p; else f *= *p;
+            }
+        }
+        if(neg) f = -f;
+        memcpy(v, &f, 4);
+    }
+    return 0;
 }
 
-void gpib_listen(void)
+void pack_flush(void)
 {
-    TRISB = 0xFF;           // Switch data port to input
-    LATDbits.LD4 = 0;       // TE Talk enable
-    
-                            // Enable NDAC, NRFD as tx; DAV as rx
-    LATAbits.LA4 = 1;       // NDAC high
-    LATAbits.LA3 = 1;       // NRFD high
-    TRISAbits.RA2 = 1;      // DAV as input
-    LATDbits.LD7 = 0;       // TE2 Talk enable
-    TRISAbits.RA4 = 0;      // NDAC as output
-    TRISAbits.RA3 = 0;      // NRFD as output
+    uint8_t *v = pack.val;
+    uint8_t n = pack.cnt << 2;
+    rx_put(0x80 + config.pack);
+    rx_put(pack.cnt);
+    while(n--) rx_put(*v++);
+    pack.cnt = 0;
+}
+
+void pack_field(char c)
+{
+    pack.fld[pack.n] = 0;
+    if(pack.n || c == ',' || c == ';') {
+        if(!pack_parse(pack.fld, pack.val + (pack.cnt << 2))) {
+            pack.n = 0;
+            if(++pack.cnt == sizeof(pack.val) / 4) pack_flush();
+            return;
+        }
+        if(pack.cnt) pack_flush();
+        pack.raw = 1;           // - Not a number: fall back to text
+        for(uint8_t i = 0; i < pack.n; ++i) rx_put(pack.fld[i]);
+        if(c) rx_put(c);
+    }
+    pack.n = 0;
+}
+
+void pack_byte(uint8_t b)
+{
+    if(pack.raw) {
+        rx_put(b);
+    } else if(b == ',' || b == ';' || b == '\r' || b == '\n') {
+        pack_field(b);
+    } else if(pack.n < sizeof(pack.fld) - 1) {
+        pack.fld[pack.n++] = b;
+    } else {                    // - Field too long for a number
+        if(pack.cnt) pack_flush();
+        pack.raw = 1;
+        for(uint8_t i = 0; i < pack.n; ++i) rx_put(pack.fld[i]);
+        rx_put(b);
+        pack.n = 0;
+    }
+}
+
+void pack_end(void)
+{
+    if(!pack.raw) {
+        pack_field(0);
+        if(!pack.raw) {
+            if(pack.cnt) pack_flush();
+            pack_flush();       // Empty frame ends the reply
+        }
+    }
+    pack.raw = pack.n = pack.cnt = 0;
+}
+
+/*
+ SCPI messages, for ++auto 2
+ A message is split into units at ';' outside strings and blocks. A unit
+   whose header ends in '?' is a query. Replies are split the same way to
+   count the answers, which a device may send as one message or several.
+*/
+
+enum {                  // - Scanner states
+    SC_HEAD = 0,        // Unit header
+    SC_BODY,            // Parameters
+    SC_QUOTE,           // String, ends with the quote it started with
+    SC_LEN,             // '#' seen, next the number of length digits
+    SC_DIGITS,          // Block length
+    SC_BLOCK,           // Block data
+    SC_REST             // Indefinite length block, rest of the message
+};
+
+typedef struct {
+    uint8_t state;
+    uint8_t all;            // Count every unit, not only queries
+    uint8_t on;             // Scan replies as they arrive
+    uint8_t used;           // Unit has more than white space
+    uint8_t q;              // Header so far ends in '?'
+    char quote;
+    uint8_t digits;         // Block length digits left
+    uint32_t block;         // Block bytes left
+    uint8_t units;          // Units counted
+} TSCPI;
+
+TSCPI scpi_tx = { 0 };      // Message to the device, counts queries
+TSCPI scpi_rx = { 0 };      // Its replies, counts answers
+
+void scpi_start(TSCPI *s, uint8_t all)
+{
+    memset(s, 0, sizeof(*s));
+    s->all = all;
+}
+
+void scpi_unit(TSCPI *s)
+{
+    // - End of a unit, also called at the end of a message
+    if(s->used && (s->all || s->q)) ++s->units;
+    s->used = s->q = 0;
+    s->state = SC_HEAD;
+}
+
+void scpi_scan(TSCPI *s, char c)
+{
+    switch(s->state) {
+        case SC_HEAD:
+            if(c == ';') {
+                scpi_unit(s);
+            } else if((uint8_t)c <= ' ') {
+                if(s->used) s->state = SC_BODY;
+            } else {
+                s->used = 1;
+                s->q = c == '?';
+                if(c == '#') {          // Reply that is a block
+                    s->state = SC_LEN;
+                } else if(c == '"' || c == '\'') {
+                    s->quote = c;
+                    s->state = SC_QUOTE;
+                }
+            }
+            break;
+        case SC_BODY:
+            if(c == ';') {
+                scpi_unit(s);
+            } else if(c == '"' || c == '\'') {
+                s->quote = c;
+                s->state = SC_QUOTE;
+            } else if(c == '#') {
+                s->state = SC_LEN;
+            }
+            break;
+        case SC_QUOTE:
+            if(c == s->quote) s->state = SC_BODY;   // "" reenters
+            break;
+        case SC_LEN:
+            if(c > '0' && c <= '9') {
+                s->digits = c - '0';
+                s->block = 0;
+                s->state = SC_DIGITS;
+            } else {                    // #0 or #H, #Q, #B numbers
+                s->state = c == '0' ? SC_REST : SC_BODY;
+            }
+            break;
+        case SC_DIGITS:
+            s->block = s->block * 10 + (uint8_t)(c - '0');
+            if(!--s->digits) s->state = s->block ? SC_BLOCK : SC_BODY;
+            break;
+        case SC_BLOCK:
+            if(!--s->block) s->state = SC_BODY;
+            break;
+    }
+}
+
+/*
+ Background tasks
+ These never start a bus transfer. task_idle() runs them between host
+   lines, task_yield() while a transfer waits on the handshake lines.
+   line.buf holds the message being sent then, so a "++" line that
+   comes in meanwhile is taken into line.next without echo. It runs,
+   and is echoed, once the current line is done: running it early
+   would mix its reply into the one under way. Anything else, and what
+   follows, collects in the UART ring buffer under flow control.
+ Device mode transfers are stepped from task_idle(), see
+   gpib_device_task().
+*/
+
+enum {                  // - Host line states
+    LINE_EDIT = 0,      // Collecting characters
+    LINE_FULL,          // Buffer full of data, send it and carry on
+    LINE_DONE           // CR or LF received
+};
+
+typedef struct {
+    uint8_t state;
+    uint8_t n;              // Chars in buf
+    uint8_t end;            // Length of the previous line for ctrl-K
+    uint8_t esc;            // ESC received, next char is taken literally
+    uint8_t lit;            // First char was escaped, line is data
+    uint8_t more;           // Part of a long data message already sent
+    uint8_t over;           // Command line too long, chars were dropped
+    uint8_t err;            // Result of the last data line, for ++data_err
+    uint8_t next_n;         // Chars in next
+    uint8_t next_done;      // next is a whole line
+    char buf[256];
+    char next[64];          // "++" line taken during a transfer
+} TLINE;
+
+TLINE line = { 0 };
+
+void line_ahead(void)
+{
+    // - Take in a "++" line while line.buf is busy. A control char or a
+    //   line too long for next is left to line_task() and ends it.
+    char c;
+    while(!line.next_done && uart_rx_ready()) {
+        c = uart_peek();
+        if(c == 10 || c == 13) {
+            line.next_done = 1;
+        } else if(!line.next_n && c != '+') {
+            return;     // Data waits in the ring buffer
+        } else if(c == 8) {
+            --line.next_n;
+        } else if(c < 32 || line.next_n == sizeof(line.next) - 1) {
+            return;
+        } else {
+            line.next[line.next_n++] = c;
+        }
+        uart_getc();
+    }
+}
+
+void line_resume(void)
+{
+    // - Start the new line with what line_ahead() took in
+    memcpy(line.buf, line.next, line.next_n);
+    line.n = line.next_n;
+    line.buf[line.n] = 0;
+    if(config.echo) {
+        print(line.buf);
+        if(line.next_done) print("\r\n");
+    }
+    if(line.next_done) line.state = LINE_DONE;
+    line.next_n = line.next_done = 0;
+}
+
+void line_task(void)
+{
+    char c;
+    if(line.state != LINE_EDIT) {
+        line_ahead();
+        return;
+    }
+    while(line.state == LINE_EDIT && uart_rx_ready()) {
+        c = uart_getc();
+        if(c < 32 && !line.esc) {
+            switch(c) {
+                case 10:    // LF
+                case 13:    // CR
+                    line.buf[line.n] = 0;
+                    line.state = LINE_DONE;
+                    if(config.echo) print("\r\n");
+                    break;
+                case 27:    // ESC
+                    line.esc = c;
+                    break;
+                case 8:     // BS
+                    if(line.n) {
+                        --line.n;
+                        if(config.echo) print("\x8 \x8");
+                    }
+                    break;
+                case 11:    // VT (ctrl-k, recall previous command line)
+                    while(line.n < line.end) {
+                        if(!line.buf[line.n]) line.buf[line.n] = ' ';
+                        uart_putc(line.buf[line.n++]);
+                    }
+                    break;
+            }
+        } else {
+            if(line.esc) {
+                line.esc = 0;
+                if(!line.n) line.lit = 1;
+                if(c >= 0x40) c &= 0x1F;    // ESC M -> CR, ESC + -> +
+            }
+            if(line.n == sizeof(line.buf) - 1) {
+                line.over = 1;  // Command line too long: drop
+                continue;
+            }
+            line.buf[line.n++] = c;
+            if(config.echo) uart_putc(c);
+            if(line.n == sizeof(line.buf) - 1 &&
+               (line.buf[0] != '+' || line.lit || line.more)) {
+                line.buf[line.n] = 0;
+                line.state = LINE_FULL;
+            }
+        }
+    }
+}
+
+typedef struct {
+    uint8_t asserted;       // SRQ was asserted last time we looked
+    uint8_t report;         // Tell the host once idle
+} TSRQ;
+
+TSRQ srq = { 0 };
+
+void srq_task(void)
+{
+    if(!config.mode) return;
+    uint8_t a = !PORTEbits.RE0;
+    if(a && !srq.asserted && config.srq_auto) srq.report = 1;
+    srq.asserted = a;
+}
+
+void task_yield(void)
+{
+    // - Run by gpib_run() while a transfer waits
+    uart_xoff();
+    line_task();
+    srq_task();
+}
+
+/*
+ Query latency
+ The time from the last byte of a message to a device to the first byte
+   of its reply is kept per address as a histogram of buckets 4 times
+   apart: bucket n is below 21.3 us << 2n, the last one takes the rest
+   (>= 87 ms)
+ Only a read from the host line that sent the message is timed, as with
+   ++auto, a batch "query;++read" or ++fanout. A ++read on a later line
+   would time the host as well.
+ When an address has LAT_KEEP replies counted all its counts are halved,
+   which keeps the shape of the distribution and lets old replies fade.
+ With ++auto_tmo pad on the wait for the first byte of a reply from pad
+   is 4 times the bucket that holds all but the slowest 1/64 of its
+   replies, within ++auto_tmo min and max, in place of the listen
+   timeout. A read that gets no reply fails that much sooner, a slow
+   device gets the wait it needs.
+ A read that gets nothing is not a latency sample: it may be a lost
+   query rather than a slow device. Only every LAT_MISS misses in a row
+   count as one reply that came just before the wait ran out, which puts
+   the next timeout one bucket up. A device that has become slower gets
+   longer timeouts again without one miss stretching them to the max.
+*/
+
+#define LAT_BUCKETS 8
+#define LAT_LEARN   8       // Replies seen before the timeout is learned
+#define LAT_MARGIN  2       // Timeout is the bucket bound << LAT_MARGIN
+#define LAT_KEEP    128     // Replies counted before they are halved
+#define LAT_MISS    4       // Misses in a row that count as one reply
+
+typedef struct {
+    uint8_t pad;            // Message sent to this address + 1, 0 = none
+    uint8_t sad;            //   and secondary address
+    uint8_t armed;          // Reading its reply, time the first byte
+    uint32_t sent;          // Timer 1 when the message's last byte was taken
+    uint8_t hist[31][LAT_BUCKETS];
+    uint8_t miss[31];       // Reads without a reply since the last one
+} TLAT;
+
+TLAT lat = { 0 };
+
+void lat_add(uint8_t *h, uint32_t t)
+{
+    // - Count a latency of t timer 0 ticks, 21.3 us each
+    uint8_t b = 0, i, n = 0;
+    for(; t && b < LAT_BUCKETS - 1; t >>= 2) ++b;
+    ++h[b];
+    for(i = 0; i < LAT_BUCKETS; ++i) n += h[i];
+    if(n >= LAT_KEEP)
+        for(i = 0; i < LAT_BUCKETS; ++i) h[i] >>= 1;
+}
+
+void lat_reply(void)
+{
+    uint32_t t = timer1() - lat.sent;
+    uint8_t pad = lat.pad - 1;
+    lat.armed = lat.pad = 0;
+    lat.miss[pad] = 0;
+    lat_add(lat.hist[pad], t >> 5);
+}
+
+void lat_miss(uint8_t pad, uint16_t t)
+{
+    // - No reply from pad within timer 0 value t
+    if(++lat.miss[pad] < LAT_MISS) return;
+    lat.miss[pad] = 0;
+    lat_add(lat.hist[pad], (uint16_t)~t - 1);
+}
+
+uint16_t lat_timeout(uint8_t pad)
+{
+    // - Learned first byte timeout for pad as a timer 0 value,
+    //   0 = too few replies seen yet
+    uint8_t *h = lat.hist[pad], b;
+    uint16_t n = 0, skip, t;
+    for(b = 0; b < LAT_BUCKETS; ++b) n += h[b];
+    if(n < LAT_LEARN) return 0;
+    skip = n >> 6;
+    for(b = LAT_BUCKETS - 1; h[b] <= skip; --b) skip -= h[b];
+    if(2 * b + LAT_MARGIN > 15) return timeout.auto_max;
+    t = ~(1U << (2 * b + LAT_MARGIN));
+    if(t > timeout.auto_min) t = timeout.auto_min;
+    if(t < timeout.auto_max) t = timeout.auto_max;
+    return t;
+}
+
+typedef struct {
+    uint8_t listen;         // Addressed to listen
+    uint8_t talk;           // Addressed to talk
+    uint8_t spoll;          // Serial poll enabled
+    uint8_t polled;         // Status byte sent since the last command
+    uint8_t pend;           // MLA / MTA seen, waiting for our SAD
+    uint8_t held;           // DAV of a byte already taken is still low
+    uint8_t more;           // The host has more of the message, no EOI yet
+    uint8_t xf;             // Transfer under way, DX_...
+    uint8_t stb;            // Status byte being sent
+    uint8_t len;            // Length of data waiting to be sent
+    uint8_t buf[128];       // Data from host waiting for talk address
+} TDEVICE;
+
+TDEVICE device = { 0 };
+
+/*
+ Response cache (++cache 1)
+ Replies to the queries in cache.queries, *IDN? and *OPT? unless set with
+   ++cache query, are kept per address. When one of them is sent again to
+   the same address it doesn't go on the bus, the read after it gets the
+   kept reply.
+ Entries are pad, sad, query length, reply length, query, reply, in
+   cache.buf. A reply that doesn't fit after the other entries starts the
+   cache over.
+ ++cache flush, ++ifc, ++mode, ++rst and a DCL or SDC sent on the bus,
+   e.g. by ++clr, empty it.
+*/
+
+typedef struct {
+    uint8_t on;
+    uint8_t hit;            // Entry + 1 to answer the next read from, 0 = none
+    uint8_t pend;           // The next read's reply goes into the entry at used
+    uint8_t fill;           // Reading that reply
+    uint8_t n;              // Bytes of that entry so far
+    uint8_t used;           // Bytes of complete entries
+    char queries[24];       // Queries to keep, each ended by a NUL, then a NUL
+    uint8_t buf[240];       // Entries
+} TCACHE;
+
+TCACHE cache = { 0, 0, 0, 0, 0, 0, "*IDN?\0*OPT?" };
+
+void cache_flush(void)
+{
+    cache.used = cache.hit = cache.pend = 0;
+}
+
+uint8_t cache_wanted(char const *q, uint8_t l)
+{
+    char const *s;
+    if(!cache.on) return 0;
+    for(s = cache.queries; *s; s += strlen(s) + 1)
+        if(strlen(s) == l && !memcmp(s, q, l)) return 1;
+    return 0;
+}
+
+uint8_t cache_find(char const *q, uint8_t l)
+{
+    // - Entry + 1 for query q to config.addr, 0 = none
+    uint8_t i = 0, *e;
+    while(i < cache.used) {
+        e = cache.buf + i;
+        if(e[0] == config.addr && e[1] == config.sad && e[2] == l &&
+           !memcmp(e + 4, q, l))
+            return i + 1;
+        i += 4 + e[2] + e[3];
+    }
+    return 0;
+}
+
+void cache_start(char const *q, uint8_t l)
+{
+    // - Query q has been sent, keep the reply read next
+    uint8_t *e;
+    if(4 + l >= sizeof(cache.buf)) return;
+    if(cache.used + 4 + l >= sizeof(cache.buf)) cache.used = 0;
+    e = cache.buf + cache.used;
+    e[0] = config.addr;
+    e[1] = config.sad;
+    e[2] = l;
+    e[3] = 0;
+    memcpy(e + 4, q, l);
+    cache.n = 4 + l;
+    cache.pend = 1;
+}
+
+void cache_put(uint8_t b)
+{
+    if(cache.used + cache.n == sizeof(cache.buf)) {
+        if(!cache.used) {       // Too long to keep
+            cache.fill = 0;
+            return;
+        }
+        memmove(cache.buf, cache.buf + cache.used, cache.n);
+        cache.used = 0;
+    }
+    cache.buf[cache.used + cache.n++] = b;
+    ++cache.buf[cache.used + 3];
+}
+
+/*
+ Bus transfers
+ A transfer is a state machine advanced by gpib_step() which returns
+   instead of waiting on a handshake line. gpib_tx() and gpib_rx() start
+   one and run the background tasks until it is done. A transfer ends
+   early on a handshake timeout or when the host sends ctrl-C.
+ Device mode runs the same states with GPIB_DEV, one gpib_step() per
+   call of gpib_device_task(), so the main loop keeps going meanwhile.
+   The controller ends such a transfer by changing ATN or with IFC.
+*/
+
+enum {                  // - gpib_tx() flags
+    GPIB_DATA = 0,      // Data, EOI on the last byte
+    GPIB_CMD  = 1,      // Command, sent with ATN asserted
+    GPIB_MORE = 2,      // Data, more follows so no EOI
+    GPIB_DEV  = 4       // Device mode transfer
+};
+
+enum {                  // - Transfer results
+    GPIB_OK = 0,
+    GPIB_TIMEOUT,       // Handshake timed out
+    GPIB_ABORT,         // Cancelled by the host
+    GPIB_ATN            // Device mode: ATN changed or IFC
+};
+
+enum {                  // - Transfer states
+    XF_IDLE = 0,
+    XF_TX_BYTE,         // Put the next byte on the bus
+    XF_TX_NRFD,         // Wait for NRFD high, assert DAV
+    XF_TX_NDAC,         // Wait for NDAC high, deassert DAV
+    XF_TX_NEXT,         // Wait for NDAC low
+    XF_RX_BYTE,         // Deassert NRFD
+    XF_RX_DAV,          // Wait for DAV low, take the byte
+    XF_RX_NEXT          // Wait for DAV high, assert NDAC
+};
+
+// - Fast handshake
+//   A listener or talker that takes longer than the first poll of a
+//   handshake line costs a return through task_yield() per wait, so
+//   the line is polled up to HS_SPIN times first, a few us, which
+//   keeps a fast device's bytes back to back. A slower device falls
+//   back to the timed waits.
+#define HS_SPIN 24
+#define SPIN(n, c) for(n = HS_SPIN; n && (c); --n)   // Counter n, a uint8_t
+
+typedef struct {
+    uint8_t state;
+    uint8_t flags;          // gpib_tx() flags
+    uint8_t err;
+    uint8_t eoi;            // EOI was asserted with the last byte received
+    uint8_t l;              // Bytes left, 0 = until EOI when receiving
+    uint8_t n;              // Bytes taken by the listeners
+    uint8_t const *b;       // Data to send
+    uint8_t *buf;           // Received data, 0 = to the host
+    uint16_t tmo;           // Timer 0 value for the handshake timeout
+    uint16_t tmo_next;      // Timeout after the first byte, 0 = the same
+} TXFER;
+
+TXFER xfer = { 0 };
+
+void gpib_rx_put(uint8_t b)
+{
+    if(scpi_rx.on) scpi_scan(&scpi_rx, (char)b);
+    if(cache.fill) cache_put(b);
+    if(config.pack) {
+        pack_byte(b);
+    } else if(config.compress) {
+        rle_byte(b);
+    } else {
+        while(!PIR1bits.TXIF);  // Wait for tx reg empty
+        TXREG1 = b;             // Tx on serial
+    }
+}
+
+void gpib_device_cmd(uint8_t b);
+
+uint8_t gpib_wait(void)
+{
+    // - Handshake line not ready: returns 1 if the transfer must stop
+    //   A device takes commands while ATN is asserted, data while not
+    if(uart.abort) {
+        xfer.err = GPIB_ABORT;
+    } else if(INTCONbits.TMR0IF) {
+        xfer.err = GPIB_TIMEOUT;
+    } else if(xfer.flags & GPIB_DEV && (!PORTEbits.RE1 ||
+              PORTAbits.RA5 == !(xfer.flags & GPIB_CMD))) {
+        xfer.err = GPIB_ATN;
+    } else {
+        LATDbits.LD2 = 0;       // Red LED on
+        return 0;
+    }
+    return 1;
+}
+
+void gpib_step(void)
+{
+    uint8_t n = 64;             // Bytes before the other tasks get a turn
+    uint8_t b, s;
     
-                            // Enable ATN as tx, SRQ, EOI as rx
-    LATAbits.LA5 = 1;       // ATN high
-    TRISEbits.RE0 = 1;      // SRQ as input
-    TRISAbits.RA1 = 1;      // EOI as input
-    LATDbits.LD5 = 0;       // DC Direction control
-    TRISAbits.RA5 = 0;      // ATN as output
+    for(;;) {
+        switch(xfer.state) {
+            case XF_TX_BYTE:
+                if(!n--) return;
+                TMR0L = (uint8_t)xfer.tmo;
+                INTCONbits.TMR0IF = 0;
+                if(xfer.l == 1 && !(xfer.flags & (GPIB_CMD | GPIB_MORE)) &&
+                   config.eoi)          // Assert EOI for last byte
+                    TRISAbits.RA1 = 0;  //  if not command
+                LATB = *xfer.b++ ^ 0xFFU;    // Put data on GPIB bus
+                xfer.state = XF_TX_NRFD;
+                // Fall through
+            case XF_TX_NRFD:
+                SPIN(s, !PORTAbits.RA3);
+                if(!PORTAbits.RA3) {    // Wait for NRFD to go high
+                    if(gpib_wait()) goto stop;
+                    return;
+                }
+                LATAbits.LA2 = 0;       // Assert DAV
+                xfer.state = XF_TX_NDAC;
+                // Fall through
+            case XF_TX_NDAC:
+                SPIN(s, !PORTAbits.RA4);
+                if(!PORTAbits.RA4) {    // Wait for NDAC to go high
+                    if(gpib_wait()) goto stop;
+                    return;
+                }
+                LATAbits.LA2 = 1;       // Deassert DAV
+                ++xfer.n;
+                xfer.state = XF_TX_NEXT;
+                // Fall through
+            case XF_TX_NEXT:
+                SPIN(s, PORTAbits.RA4);
+                if(PORTAbits.RA4) {     // Wait for NDAC to go low
+                    if(gpib_wait()) goto stop;
+                    return;
+                }
+                LATDbits.LD2 = 1;       // Red LED off
+                xfer.state = --xfer.l ? XF_TX_BYTE : XF_IDLE;
+                continue;
+                
+            case XF_RX_BYTE:
+                if(!n--) return;
+                TMR0L = (uint8_t)xfer.tmo;
+                INTCONbits.TMR0IF = 0;
+                LATAbits.LA3 = 1;       // Deassert NRFD
+                xfer.state = XF_RX_DAV;
+                // Fall through
+            case XF_RX_DAV:
+                SPIN(s, PORTAbits.RA2);
+                if(PORTAbits.RA2) {     // Wait for DAV
+                    if(gpib_wait()) goto stop;
+                    return;
+                }
+                if(lat.armed) lat_reply();
+                if(xfer.tmo_next) {
+                    xfer.tmo = xfer.tmo_next;
+                    TMR0H = xfer.tmo >> 8;  // Taken at the next TMR0L write
+                    xfer.tmo_next = 0;
+                }
+                LATAbits.LA3 = 0;       // Assert NRFD
+                b = PORTB ^ 0xFFU;      // Read data
+                xfer.eoi = !PORTAbits.RA1;  // Read EOI
+                LATAbits.LA4 = 1;       // Deassert NDAC
+                if(xfer.flags & GPIB_CMD)
+                    gpib_device_cmd(b);
+                else if(xfer.buf)
+                    *xfer.buf++ = b;
+                else
+                    gpib_rx_put(b);
+                xfer.state = XF_RX_NEXT;
+                // Fall through
+            case XF_RX_NEXT:
+                SPIN(s, !PORTAbits.RA2);
+                if(!PORTAbits.RA2) {    // Wait for DAV to go high
+                    if(gpib_wait()) goto stop;
+                    return;
+                }
+                LATAbits.LA4 = 0;       // Assert NDAC
+                LATDbits.LD2 = 1;       // Red LED off
+                if((xfer.eoi && !(xfer.flags & GPIB_CMD)) ||
+                   (xfer.l && !--xfer.l))
+                    xfer.state = XF_IDLE;
+                else
+                    xfer.state = XF_RX_BYTE;
+                continue;
+                
+            default:
+                return;
+        }
+    }
+stop:
+    if(xfer.flags & GPIB_DEV)
+        ;                       // gpib_device_end() sorts out the bus
+    else if(xfer.state >= XF_RX_BYTE)
+        LATAbits.LA4 = 1;       // Deassert NDAC
+    else
+        LATAbits.LA2 = 1;       // Deassert DAV
+    LATDbits.LD2 = 1;           // Red LED off
+    xfer.state = XF_IDLE;
+}
+
+void gpib_start(uint16_t tmo)
+{
+    // - Transfer set up in xfer, go with handshake timeout tmo
+    xfer.err = GPIB_OK;
+    xfer.n = 0;
+    xfer.tmo = tmo;
+    TMR0H = tmo >> 8;
+}
+
+uint8_t gpib_run(uint16_t tmo)
+{
+    gpib_start(tmo);
+    while(xfer.state) {
+        gpib_step();
+        task_yield();
+    }
+    return xfer.err;
 }
 
-void gpib_tx(uint8_t const *b, uint8_t l, uint8_t c)
+uint8_t gpib_tx(uint8_t const *b, uint8_t l, uint8_t c)
 {
+    uint8_t i, talk = 0;
     if(!l) l = strlen((char *)b);
-    if(!l) return;
+    if(!l) return GPIB_OK;
+    if(!(c & GPIB_CMD)) cache.hit = cache.pend = 0;    // Read is not its reply
+    for(i = 0; c & GPIB_CMD && i < l; ++i) {
+        if(b[i] == DCL || b[i] == SDC) cache_flush();   // Devices reset
+        if(b[i] >= TAD && b[i] <= UNT) talk = b[i] != UNT;
+    }
     
+    if(c & GPIB_CMD) bus.state = BUS_UNKNOWN;
     LATDbits.LD0 = 0;           // Blue LED on
-    gpib_talk(c);
+    gpib_role(c & GPIB_CMD ? ROLE_CMD : ROLE_DATA);
     LATDbits.LD3 = 1;           // Enable pullup drivers
-    if(c) LATAbits.LA5 = 0;     // Assert ATN
-    TMR0H = timeout.talk_timeout >> 8;
-    TMR0L = 0;
-    INTCONbits.TMR0IF = 0;
-    do {
-        TMR0L = timeout.talk_timeout;
-        if(l == 1 && !c && config.eoi) // Assert EOI for last byte
-            TRISAbits.RA1 = 0;  //  if not command
-        LATB = *b++ ^ 0xFFU;    // Put data on GPIB bus
-        if(!PORTAbits.RA3) {// Wait for NRFD to go high
-            LATDbits.LD2 = 0; // Red LED on
-            do {
-                if(INTCONbits.TMR0IF)
-                    break;
-            } while(!PORTAbits.RA3);
-            LATDbits.LD2 = 1;// Red LED off
-        }
-        LATAbits.LA2 = 0;       // Assert DAV
-        if(!PORTAbits.RA4) {  // Wait for NDAC to go high
-            LATDbits.LD2 = 0;
-            do {
-                if(INTCONbits.TMR0IF)
-                    break;
-            } while(!PORTAbits.RA4);
-            LATDbits.LD2 = 1;
-        }
-        LATAbits.LA2 = 1;       // Deassert DAV
-        if(PORTAbits.RA4) {   // Wait for NDAC to go low
-            LATDbits.LD2 = 0;
-            do {
-                if(INTCONbits.TMR0IF)
-                    break;
-            } while(PORTAbits.RA4);
-            LATDbits.LD2 = 1;
-        }
-    } while(--l);
+    if(c & GPIB_CMD) LATAbits.LA5 = 0;     // Assert ATN
+    xfer.b = b;
+    xfer.l = l;
+    xfer.flags = c;
+    xfer.state = XF_TX_BYTE;
+    gpib_run(timeout.talk_timeout);
+    if(!c && !xfer.err && bus.state == BUS_LISTEN) {
+        lat.sent = timer1();    // End of a message, time the reply
+        lat.pad = bus.pad + 1;
+        lat.sad = bus.sad;
+    }
 
     LATB = 0xFF;
     LATDbits.LD3 = 0;           // Disable pullup drivers
-    TRISAbits.RA1 = 1;          // Deassert EOI
-    if(c) LATAbits.LA5 = 1;     // Deassert ATN
-    gpib_listen();
+    if(c & GPIB_CMD) {
+        // - A device addressed to talk starts as soon as ATN goes, so
+        //   hold the handshake first. Otherwise the data burst that
+        //   follows goes straight from this role.
+        if(talk) gpib_role(ROLE_LISTEN);
+        LATAbits.LA5 = 1;       // Deassert ATN
+    } else {
+        TRISAbits.RA1 = 1;      // Deassert EOI
+    }
     LATDbits.LD0 = 1;           // Blue LED off
+    return xfer.err;
 }
 
-void gpib_rx(void)
+uint8_t gpib_recv(uint8_t *buf, uint8_t len, uint16_t tmo)
 {
-    uint8_t b;
-    uint8_t eoi;
-    
     LATDbits.LD0 = 0;           // Blue LED on
+    gpib_role(ROLE_LISTEN);
     LATAbits.LA4 = 0;           // Assert NDAC
-    TMR0H = timeout.listen_timeout >> 8;
-    TMR0L = 0;
-    INTCONbits.TMR0IF = 0;
-    do {
-        LATAbits.LA3 = 1;       // Deassert NRFD
-        TMR0L = timeout.listen_timeout;
-        if(PORTAbits.RA2) {   // Wait for DAV
-            LATDbits.LD2 = 0;
-            do {
-                if(INTCONbits.TMR0IF) {
-                    LATAbits.LA4 = 1;
-                    break;
-                }
-            } while(PORTAbits.RA2);
-            LATDbits.LD2 = 1;
-        }
-        if(INTCONbits.TMR0IF) break;
-        LATAbits.LA3 = 0;       // Assert NRFD
-        b = PORTB ^ 0xFFU;      // Read data
-        eoi = PORTA;            // Read EOI
-        LATAbits.LA4 = 1;       // Deassert NDAC
-        while(!PIR1bits.TXIF);  // Wait for tx reg empty
-        TXREG1 = b;             // Tx on serial
-        if(!PORTAbits.RA2) {  // Wait for DAV
-            LATDbits.LD2 = 0;
-            do {
-                if(INTCONbits.TMR0IF) {
-                    eoi = 0;
-                    break;
-                }
-            } while(!PORTAbits.RA2);
-            LATDbits.LD2 = 1;
+    xfer.buf = buf;
+    xfer.l = len;
+    xfer.eoi = 0;
+    xfer.flags = GPIB_DATA;
+    xfer.state = XF_RX_BYTE;
+    gpib_run(tmo);
+    LATDbits.LD0 = 1;           // Blue LED off
+    return xfer.err;
+}
+
+void gpib_rx_end(void)
+{
+    // - End of a reply to the host
+    //   The eot char is reply data, compressed with the rest so it
+    //   can't be taken for a frame header. Packed replies end with
+    //   their own frame and get none.
+    if(config.pack)
+        pack_end();
+    else if(config.eot_enable)
+        rx_put(config.eot_char);
+    if(config.compress) rle_end();
+}
+
+uint8_t gpib_rx(void)
+{
+    uint16_t t, tmo = timeout.listen_timeout;
+    uint8_t learn;
+    lat.armed = lat.pad && bus.state == BUS_TALK && lat.pad == bus.pad + 1 &&
+                lat.sad == bus.sad;
+    learn = lat.armed && (config.auto_tmo >> bus.pad) & 1;
+    if(learn && (t = lat_timeout(bus.pad)))
+        tmo = t;
+    xfer.tmo_next = tmo != timeout.listen_timeout ? timeout.listen_timeout : 0;
+    cache.fill = cache.pend;
+    cache.pend = 0;
+    gpib_recv(0, 0, tmo);
+    if(learn && lat.armed && xfer.err == GPIB_TIMEOUT)
+        lat_miss(bus.pad, tmo);
+    xfer.tmo_next = 0;
+    lat.armed = lat.pad = 0;
+    if(cache.fill && !xfer.err) cache.used += cache.n;
+    cache.fill = 0;
+    return xfer.err;
+}
+
+uint8_t gpib_rx_cached(void)
+{
+    // - Send the reply kept in cache entry cache.hit
+    uint8_t *e = cache.buf + cache.hit - 1;
+    uint8_t *r = e + 4 + e[2], n = e[3];
+    cache.hit = 0;
+    while(n--) gpib_rx_put(*r++);
+    return GPIB_OK;
+}
+
+uint8_t gpib_rx_buf(uint8_t *buf, uint8_t len)
+{
+    return gpib_recv(buf, len, timeout.listen_timeout);
+}
+
+void gpib_rx1(void)
+{
+    uint8_t b = 0;
+    
+    if(gpib_recv(&b, 1, timeout.spoll_timeout)) return;
+    print("spoll "); print_uint(b); print_nl();
+    print("eoi "); print(xfer.eoi ? "1" : "0"); print_nl();
+}
+
+uint8_t gpib_address(uint8_t talk)
+{
+    // - Address config.addr / config.sad to talk or listen
+    //   Nothing is sent if the bus is already addressed that way
+    //   A new talk address unaddresses the old talker, so UNT is only
+    //   needed when we take over as talker
+    //   If the commands don't go out the bus is left BUS_UNKNOWN, so the
+    //   next message addresses it again
+    uint8_t cmd[4], *p = cmd, err;
+    uint8_t state = talk ? BUS_TALK : BUS_LISTEN;
+    if(bus.state == state && bus.pad == config.addr && bus.sad == config.sad)
+        return GPIB_OK;
+    if(talk) {
+        if(bus.state != BUS_TALK) *p++ = UNL;
+        *p++ = TAD + config.addr;
+    } else {
+        if(bus.state != BUS_LISTEN) *p++ = UNT;
+        *p++ = UNL;
+        *p++ = LAD + config.addr;
+    }
+    if(config.sad) *p++ = config.sad;
+    err = gpib_tx(cmd, (uint8_t)(p - cmd), GPIB_CMD);
+    if(err) return err;
+    bus.state = state;
+    bus.pad = config.addr;
+    bus.sad = config.sad;
+    return GPIB_OK;
+}
+
+/*
+ Device mode
+ ATN is wired to RC1 too, whose change interrupt asserts NDAC as soon as
+   a controller starts a command. The controller's handshake then waits
+   until gpib_device_task() takes the bytes from the main loop, so a
+   command that keeps the adapter busy, e.g. a long print to a slow host,
+   holds up the bus for as long. Its handshake timeout must cover that.
+*/
+
+void gpib_device_ndac(void)
+{
+    // - NDAC between handshakes: held low when listening so a talker
+    //   always waits for us, and while ATN is asserted, as the interrupt
+    //   may have just set it for a command
+    LATAbits.LA4 = device.listen ? 0 : 1;
+    if(!PORTAbits.RA5) LATAbits.LA4 = 0;
+}
+
+void gpib_device_idle(void)
+{
+    gpib_device_ndac();
+    LATAbits.LA3 = 1;       // Deassert NRFD
+    LATEbits.LE0 = (config.status & 0x40) ? 0 : 1;
+    gpib_role(ROLE_IDLE);
+}
+
+void gpib_device_talk(void)
+{
+    gpib_role(ROLE_TALK);
+}
+
+void gpib_device_srq(void)
+{
+    if(config.mode) return;
+    LATEbits.LE0 = (config.status & 0x40) ? 0 : 1;
+}
+
+void gpib_device_cmd(uint8_t b)
+{
+    b &= 0x7F;
+    device.polled = 0;
+    if(device.pend) {           // - Extended addressing: SAD must follow
+        uint8_t pend = device.pend;
+        device.pend = 0;
+        if((b & 0x60) == SAD) {
+            if(b == config.sad) {
+                if(pend == 1) device.listen = 1; else device.talk = 1;
+            }
+            return;
         }
-        LATAbits.LA4 = 0;       // Assert NDAC
-    } while(eoi & 2);
-    if(config.eot_enable) {
-        while(!PIR1bits.TXIF);  // Wait for tx reg empty
-        TXREG1 = config.eot_char;
     }
-    LATDbits.LD0 = 1;           // Blue LED off
+    if(config.sad && (b == LAD + config.addr || b == TAD + config.addr)) {
+        device.pend = b == LAD + config.addr ? 1 : 2;
+        if(device.pend == 2) device.talk = 0;
+    } else if(b == LAD + config.addr) {
+        device.listen = 1;
+    } else if(b == UNL) {
+        device.listen = 0;
+    } else if(b == TAD + config.addr) {
+        device.talk = 1;
+    } else if((b & 0x60) == TAD) {  // Other talk address or UNT
+        device.talk = 0;
+    } else if(b == SPE) {
+        device.spoll = 1;
+    } else if(b == SPD) {
+        device.spoll = 0;
+    } else if(b == DCL || (b == SDC && device.listen)) {
+        device.len = 0;
+    }
 }
 
-void gpib_rx_buf(uint8_t *buf, uint8_t len)
+enum {                  // - Device mode transfers, device.xf
+    DX_NONE = 0,
+    DX_CMD,             // Commands while ATN is asserted
+    DX_LISTEN,          // Data from the talker to the host
+    DX_TALK,            // device.buf to the listeners
+    DX_SPOLL            // Status byte for a serial poll
+};
+
+uint8_t gpib_device_begin(void)
 {
-    uint8_t b;
-    uint8_t eoi;
-    uint16_t n = 0;
+    // - Start the transfer the bus calls for, returns 0 if none
+    if(!PORTEbits.RE1) {        // - IFC clears all addressing
+        device.listen = device.talk = device.spoll = device.held = 0;
+        LATAbits.LA4 = 1;       // Release NDAC
+        return 0;
+    }
     
-    LATDbits.LD0 = 0;           // Blue LED on
-    LATAbits.LA4 = 0;           // Assert NDAC
-    TMR0H = timeout.listen_timeout >> 8;
-    TMR0L = 0;
-    INTCONbits.TMR0IF = 0;
-    do {
-        LATAbits.LA3 = 1;       // Deassert NRFD
-        TMR0L = timeout.listen_timeout;
-        if(PORTAbits.RA2) {   // Wait for DAV
-            LATDbits.LD2 = 0;
-            do {
-                if(INTCONbits.TMR0IF) {
-                    LATAbits.LA4 = 1;
-                    break;
-                }
-            } while(PORTAbits.RA2);
-            LATDbits.LD2 = 1;
-        }
-        if(INTCONbits.TMR0IF) break;
-        LATAbits.LA3 = 0;       // Assert NRFD
-        b = PORTB ^ 0xFFU;      // Read data
-        eoi = PORTA;            // Read EOI
-        LATAbits.LA4 = 1;       // Deassert NDAC
-        if(buf) {
-            *buf++ = b;
+    if(device.held) {           // - A wait for DAV to go high gave up,
+        if(!PORTAbits.RA2)      //   don't take that byte again
+            return 0;
+        device.held = 0;
+    }
+    
+    if(!PORTAbits.RA5) {        // - ATN asserted: accept commands
+        LATAbits.LA4 = 0;       // Assert NDAC
+        device.xf = DX_CMD;
+        xfer.flags = GPIB_DEV | GPIB_CMD;
+        xfer.l = 0;
+        xfer.state = XF_RX_BYTE;
+        gpib_start(timeout.listen_timeout);
+        return 1;
+    }
+    
+    if(device.talk) {           // - Addressed to talk
+        if(device.spoll) {      // Status byte, once per addressing
+            if(device.polled) return 0;
+            device.stb = config.status;
+            device.xf = DX_SPOLL;
+            xfer.b = &device.stb;
+            xfer.l = 1;
+        } else if(device.len) { // Bytes not taken before ATN stay queued
+            device.xf = DX_TALK;
+            xfer.b = device.buf;
+            xfer.l = device.len;
         } else {
-            while(!PIR1bits.TXIF);  // Wait for tx reg empty
-            TXREG1 = b;             // Tx on serial
-        }
-        if(!PORTAbits.RA2) {  // Wait for DAV
-            LATDbits.LD2 = 0;
-            do {
-                if(INTCONbits.TMR0IF) {
-                    eoi = 0;
-                    break;
-                }
-            } while(!PORTAbits.RA2);
-            LATDbits.LD2 = 1;
+            return 0;
         }
-        LATAbits.LA4 = 0;       // Assert NDAC
-    } while(--len && (eoi & 2));
+        xfer.flags = GPIB_DEV | (device.more ? GPIB_MORE : GPIB_DATA);
+        LATDbits.LD0 = 0;       // Blue LED on
+        gpib_device_talk();
+        LATDbits.LD3 = 1;       // Enable pullup drivers
+        xfer.state = XF_TX_BYTE;
+        gpib_start(timeout.talk_timeout);
+        return 1;
+    }
+    
+    if(device.listen && !PORTAbits.RA2) {
+                                // - Addressed to listen and DAV asserted
+        LATDbits.LD0 = 0;       // Blue LED on
+        device.xf = DX_LISTEN;
+        xfer.flags = GPIB_DEV;
+        xfer.buf = 0;
+        xfer.l = 0;
+        xfer.eoi = 0;
+        xfer.state = XF_RX_BYTE;
+        gpib_start(timeout.listen_timeout);
+        return 1;
+    }
+    return 0;
+}
+
+void gpib_device_end(void)
+{
+    // - The transfer in device.xf is done, or stopped with xfer.err
+    uint8_t n = xfer.n;
+    if(device.xf == DX_TALK || device.xf == DX_SPOLL) {
+        LATAbits.LA2 = 1;       // Deassert DAV
+        LATB = 0xFF;
+        LATDbits.LD3 = 0;       // Disable pullup drivers
+        TRISAbits.RA1 = 1;      // Deassert EOI
+    } else if(xfer.err == GPIB_TIMEOUT || xfer.err == GPIB_ABORT) {
+        device.held = !PORTAbits.RA2;   // Handshake stuck: IFC or the
+    }                                   //   next call sorts out the bus
+    if(device.xf == DX_TALK) {
+        if(n > device.len) n = device.len;
+        device.len -= n;
+        memmove(device.buf, device.buf + n, device.len);
+    } else if(device.xf == DX_SPOLL && n) {
+        device.polled = 1;
+        config.status &= 0xBF;  // Clear RQS once polled
+        gpib_device_srq();
+    } else if(device.xf == DX_LISTEN && xfer.eoi && !xfer.err) {
+        gpib_rx_end();
+    }
+    device.xf = DX_NONE;
+    gpib_device_idle();         // NDAC stays asserted under ATN
     LATDbits.LD0 = 1;           // Blue LED off
 }
 
-void gpib_rx1(void)
+void gpib_device_task(void)
 {
-    uint8_t b;
-    uint8_t eoi;
-    
-    LATAbits.LA4 = 0;           // Assert NDAC
-    
-    LATAbits.LA3 = 1;       // Deassert NRFD
-    while(PORTAbits.RA2);   // Wait for DAV
-    LATAbits.LA3 = 0;       // Assert NRFD
-    b = PORTB ^ 0xFFU;      // Read data
-    eoi = PORTA;            // Read EOI
-    //while(!PIR1bits.TXIF);  // Wait for tx reg empty
-    //TXREG1 = b;             // Tx on serial
-    LATAbits.LA4 = 1;       // Deassert NDAC
-    while(!PORTAbits.RA2);  // Wait for DAV
-    LATAbits.LA4 = 0;       // Assert NDAC
-    
-    print("spoll "); print_uint(b); print_nl();
-    print("eoi "); print((eoi & 2) ? "0" : "1"); print_nl();
+    // - Advance the device transfer by one step, or start one
+    if(!xfer.state && !gpib_device_begin()) return;
+    gpib_step();
+    if(!xfer.state) gpib_device_end();
+}
+
+void gpib_device_cancel(void)
+{
+    // - Drop the transfer under way, e.g. the data it sends is replaced
+    if(!xfer.state) return;
+    xfer.state = XF_IDLE;
+    xfer.err = GPIB_ABORT;
+    gpib_device_end();
+}
+
+uint8_t gpib_device_put(uint8_t const *b, uint8_t l)
+{
+    // - Queue data from the host for the controller to read
+    //   When device.buf is full the controller has to take it first, so
+    //   a message of any length streams through, EOI only at its end
+    uint8_t k;
+    while(l) {
+        if(device.len == sizeof(device.buf)) {
+            device.more = 1;
+            while(device.len && !uart.abort) {
+                gpib_device_task();
+                task_yield();
+            }
+            device.more = 0;
+            if(device.len) return GPIB_ABORT;
+        }
+        k = sizeof(device.buf) - device.len;
+        if(k > l) k = l;
+        memcpy(device.buf + device.len, b, k);
+        device.len += k;
+        b += k;
+        l -= k;
+    }
+    return GPIB_OK;
 }
 
 typedef struct {
@@ -570,20 +1813,184 @@ uint8_t cmd_debug(char **args)
     return 0;
 }
 
+uint16_t brg_safe = 0;      // Rate to fall back to, set by ++bps
+
+uint16_t bps_brg(unsigned long b)
+{
+    // - Divisor for b bps, 0 if there is none within 2%
+    unsigned long q = b ? (BRG_CLOCK + (b >> 1)) / b : 0, r, d;
+    if(!q || q > 65535) return 0;
+    r = BRG_CLOCK / q;
+    d = r > b ? r - b : b - r;
+    return d * 50 > b ? 0 : (uint16_t)q;
+}
+
 uint8_t cmd_bps(char **args)
 {
     if(args[0]) {
-        unsigned long b = atol(args[0]);
-        config.brg = (3000000ul + (b >> 1)) / b;
+        uint16_t brg = bps_brg(atol(args[0]));
+        if(!brg) {
+            print("err");
+            print_nl();
+            return 1;
+        }
+        config.brg = brg_safe = brg;
         update_brg();
     } else {
-        unsigned long b = 3000000ul / config.brg;
+        unsigned long b = BRG_CLOCK / config.brg;
         print_ulong(b);
         print_nl();
     }
     return 0;
 }
 
+#define BPS_TEST_MS 200    // Wait for each byte of the test
+#define BPS_ACK     0x06
+#define BPS_FERR    8      // Framing errors before falling back to brg_safe
+
+int16_t bps_getc(uint16_t t)
+{
+    // - Next byte from the host, -1 if none comes in timer 0 time t
+    TMR0H = t >> 8;
+    TMR0L = (uint8_t)t;
+    INTCONbits.TMR0IF = 0;
+    while(!uart_rx_ready())
+        if(INTCONbits.TMR0IF) return -1;
+    return (uint8_t)uart_getc();
+}
+
+uint8_t cmd_bps_test(char **args)
+{
+    // - Try a baud rate, the host's side of it is Client::negotiate()
+    //   Prints the rate the divisor gives and its error, or "err" if it
+    //   is more than 2% off. Then at the new rate the host sends the bytes
+    //   0 to 255, each is echoed, and BPS_ACK if it got them all back. The
+    //   rate is kept after "ok", anything else returns to the old one. A
+    //   byte lost to a framing error shows as a missing one. The old
+    //   rate becomes the one bps_task() falls back to.
+    if(!args[0]) return 1;
+    unsigned long b = atol(args[0]), r, d;
+    uint16_t brg = bps_brg(b);
+    uint16_t old = config.brg, t;
+    uint8_t i = 0, ok = 1;
+    int16_t c;
+    if(!brg) {
+        print("err");
+        print_nl();
+        return 1;
+    }
+    r = BRG_CLOCK / brg;
+    d = r > b ? r - b : b - r;
+    print_ulong(r);
+    print(r < b ? " -" : " +");
+    d = d * 10000 / b;          // Error in 0.01 %
+    print_uint((unsigned)(d / 100));
+    print(d % 100 < 10 ? ".0" : ".");
+    print_uint((unsigned)(d % 100));
+    print("%");
+    print_nl();
+    t = ms_to_tmr(BPS_TEST_MS); // Before the switch, it may print
+    while(!TXSTA1bits.TRMT);    // Let the line go out at the old rate
+    config.brg = brg;
+    update_brg();
+    
+    do {
+        c = bps_getc(t);
+        if(c != i) {
+            ok = 0;
+            break;
+        }
+        uart_putc(i);
+    } while(++i);
+    if(ok && bps_getc(t) == BPS_ACK) {
+        print("ok");
+        print_nl();
+        brg_safe = old;
+    } else {
+        while(bps_getc(t) >= 0);    // Until the host gives up
+        while(!TXSTA1bits.TRMT);
+        config.brg = old;
+        update_brg();
+        ok = 0;
+    }
+    uart.abort = 0;             // The test bytes held a ctrl-C
+    uart.ferr = 0;
+    return !ok;
+}
+
+void bps_task(void)
+{
+    // - Framing errors pile up when the host is no longer at our rate,
+    //   e.g. it restarted after ++bps_test. Go back to brg_safe and say
+    //   so there, "bps rate".
+    if(uart.ferr < BPS_FERR) return;
+    uart.ferr = 0;
+    if(config.brg == brg_safe) return;
+    while(!TXSTA1bits.TRMT);
+    config.brg = brg_safe;
+    update_brg();
+    print("bps ");
+    print_ulong(BRG_CLOCK / config.brg);
+    print_nl();
+}
+
+uint8_t cmd_flow(char **args)
+{
+    // - XON/XOFF is refused with ++pack or ++compress on: the binary
+    //   replies can hold either byte. RTS works with all replies.
+    if(args[0]) {
+        uint8_t f = (uint8_t)atoi(args[0]);
+        if(f > 2) f = 0;
+        if(f == 1 && (config.pack || config.compress)) {
+            print("err");
+            print_nl();
+            return 1;
+        }
+        config.flow = f;
+        LATCbits.LC0 = 0;       // Assert RTS
+    } else {
+        print_uint(config.flow);
+        print_nl();
+    }
+    return 0;
+}
+
+uint8_t cmd_pack(char **args)
+{
+    if(args[0]) {
+        uint8_t p = (uint8_t)atoi(args[0]);
+        if(p > 2) p = 0;
+        if(p && config.flow == 1) {
+            print("err");       // See cmd_flow()
+            print_nl();
+            return 1;
+        }
+        config.pack = p;
+    } else {
+        print_uint(config.pack);
+        print_nl();
+    }
+    return 0;
+}
+
+uint8_t cmd_compress(char **args)
+{
+    if(args[0]) {
+        uint8_t c = (uint8_t)atoi(args[0]);
+        if(c > 2) c = 0;
+        if(c && config.flow == 1) {
+            print("err");       // See cmd_flow()
+            print_nl();
+            return 1;
+        }
+        config.compress = c;
+    } else {
+        print_uint(config.compress);
+        print_nl();
+    }
+    return 0;
+}
+
 uint8_t cmd_listen_timeout(char **args)
 {
     if(args[0]) {
@@ -621,9 +2028,11 @@ uint8_t cmd_spoll_timeout(char **args)
 }
 
 uint8_t cmd_read(char **args); /// hack
+uint8_t write_data(char *b, uint8_t l, uint8_t more);
 
 uint8_t cmd_write_hex(char **args)
 {
+    if(!config.mode) return 1;
     uint8_t txb[32];
     uint8_t *pb = txb;
     char *s;
@@ -637,9 +2046,7 @@ uint8_t cmd_write_hex(char **args)
         *pb++ = b;
     }
     if(pb != txb) {
-        static uint8_t lsn_addr[] = { UNT, UNL, LAD };
-        lsn_addr[2] = LAD + config.addr;
-        gpib_tx(lsn_addr, sizeof(lsn_addr), 1);
+        if(gpib_address(0)) return 1;
         gpib_tx(txb, pb - txb, 0);
         if(config.auto_read == 1) cmd_read(0);
     }
@@ -658,12 +2065,39 @@ uint8_t cmd_echo(char **args)
     return 0;
 }
 
+uint8_t addr_parse(char const *s, uint8_t *pad, uint8_t *sad)
+{
+    // - "pad" or "pad:sad", pad 0 to 30 and sad 96 to 126 as ++addr takes
+    //   them. Returns 1 if either is out of range.
+    char const *c = strchr(s, ':');
+    int p = atoi(s), a = c ? atoi(c + 1) : 0;
+    if(*s < '0' || *s > '9' || p > 30) return 1;
+    if(c && (a < SAD || a > SAD + 30)) return 1;
+    *pad = (uint8_t)p;
+    *sad = (uint8_t)a;
+    return 0;
+}
+
 uint8_t cmd_addr(char **args)
 {
+    // - ++addr pad [sad] or ++addr pad:sad
     if(args[0]) {
-        config.addr = (uint8_t)atoi(args[0]);
+        uint8_t pad, sad;
+        if(addr_parse(args[0], &pad, &sad)) return 1;
+        if(args[1]) {
+            int a = atoi(args[1]);
+            if(sad || a < SAD || a > SAD + 30) return 1;
+            sad = (uint8_t)a;
+        }
+        config.addr = pad;
+        config.sad = sad;
+        cache.hit = cache.pend = 0;
     } else {
         print_uint(config.addr);
+        if(config.sad) {
+            print(" ");
+            print_uint(config.sad);
+        }
         print_nl();
     }
     return 0;
@@ -680,10 +2114,39 @@ uint8_t cmd_auto(char **args)
     return 0;
 }
 
+uint8_t cmd_mode(char **args)
+{
+    if(args[0]) {
+        if(!config.mode) gpib_device_cancel();
+        config.mode = option(args[0], option_on_off);
+        bus.state = BUS_UNKNOWN;
+        cache_flush();
+        device.listen = device.talk = device.spoll = device.len = 0;
+        IOCC = config.mode ? 0 : 0x02;  // ATN change interrupt on RC1
+        (void)PORTC;
+        INTCONbits.IOCIF = 0;
+        INTCONbits.IOCIE = !config.mode;
+        if(config.mode) {
+            gpib_system(1);     // Be the system controller
+            LATAbits.LA0 = 0;   // Assert REN
+            gpib_role(ROLE_LISTEN);
+        } else {
+            LATAbits.LA0 = 1;   // Deassert REN
+            gpib_device_idle();
+            gpib_system(0);     // Be a device
+        }
+    } else {
+        print_uint(config.mode);
+        print_nl();
+    }
+    return 0;
+}
+
 uint8_t cmd_clr(char **args)
 {
-    static uint8_t cmd[] = { UNT, UNL, LAD + 0, TAD + 1, SDC };
-    cmd[3] = TAD + config.addr;
+    if(!config.mode) return 1;
+    static uint8_t const cmd[] = { SDC };
+    if(gpib_address(0)) return 1;
     gpib_tx(cmd, sizeof(cmd), 1);
     return 0;
 }
@@ -734,6 +2197,9 @@ uint8_t cmd_eot_char(char **args)
 
 uint8_t cmd_ifc(char **args)
 {
+    if(!config.mode) return 1;
+    bus.state = BUS_UNKNOWN;
+    cache_flush();
     LATEbits.LE1 = 0;   // Assert IFC
     __delay_us(150);    // 150 us
     LATEbits.LE1 = 1;   // Deassert IFC
@@ -742,27 +2208,37 @@ uint8_t cmd_ifc(char **args)
 
 uint8_t cmd_llo(char **args)
 {
-    static uint8_t cmd[] = { UNT, UNL, LAD + 0, TAD + 1, LLO };
-    cmd[3] = TAD + config.addr;
+    if(!config.mode) return 1;
+    static uint8_t const cmd[] = { LLO };
+    if(gpib_address(0)) return 1;
     gpib_tx(cmd, sizeof(cmd), 1);
     return 0;
 }
 
 uint8_t cmd_loc(char **args)
 {
-    static uint8_t cmd[] = { UNT, UNL, LAD + 0, TAD + 1, GTL };
-    cmd[3] = TAD + config.addr;
+    if(!config.mode) return 1;
+    static uint8_t const cmd[] = { GTL };
+    if(gpib_address(0)) return 1;
     gpib_tx(cmd, sizeof(cmd), 1);
     return 0;
 }
 
+uint8_t gpib_read(void)
+{
+    // - Reply of the addressed device to the host, without its end
+    uint8_t err;
+    if(cache.hit) return gpib_rx_cached();
+    err = gpib_address(1);
+    return err ? err : gpib_rx();
+}
+
 uint8_t cmd_read(char **args)
 {
-    static uint8_t talk_addr[] = { UNT, UNL, TAD };
-    talk_addr[2] = TAD + config.addr;
-    gpib_tx(talk_addr, sizeof(talk_addr), 1);
-    gpib_rx();
-    return 0;
+    if(!config.mode) return 1;
+    uint8_t e = gpib_read();
+    gpib_rx_end();
+    return e;
 }
 
 uint8_t cmd_reset(char **args)
@@ -771,13 +2247,196 @@ uint8_t cmd_reset(char **args)
     return 0;
 }
 
+#define FINDLSTN_US 50   // Time for unaddressed listeners to release NDAC
+
+uint8_t gpib_probe(uint8_t const *cmd, uint8_t l)
+{
+    // - Address a listener, then release ATN as talker without data
+    //   An addressed listener holds NDAC low, all others release it
+    //   Returns 1 if there is one, 0 if not, 2 if the commands didn't
+    //   go out, e.g. no device at all accepts them
+    uint8_t us = FINDLSTN_US;
+    if(gpib_tx(cmd, l, GPIB_CMD)) return 2;
+    gpib_role(ROLE_DATA);
+    while(!PORTAbits.RA4) {
+        if(!--us) break;
+        __delay_us(1);
+    }
+    gpib_role(ROLE_LISTEN);
+    return !us;
+}
+
+uint8_t cmd_latency(char **args)
+{
+    // - Query latency histogram, bucket counts for each address
+    //   ++latency           addresses with replies, "pad: n0 n1 ... n7"
+    //   ++latency pad       one address
+    //   ++latency clear
+    uint8_t pad, i, one = 0xFF;
+    if(args[0]) {
+        if(!strcmp(args[0], "clear")) {
+            memset(lat.hist, 0, sizeof(lat.hist));
+            memset(lat.miss, 0, sizeof(lat.miss));
+            return 0;
+        }
+        one = (uint8_t)atoi(args[0]);
+        if(one > 30) return 1;
+    }
+    for(pad = 0; pad <= 30; ++pad) {
+        uint8_t *h = lat.hist[pad];
+        if(one == 0xFF) {
+            for(i = 0; i < LAT_BUCKETS && !h[i]; ++i);
+            if(i == LAT_BUCKETS) continue;
+        } else if(pad != one) {
+            continue;
+        }
+        print_uint(pad);
+        print(":");
+        for(i = 0; i < LAT_BUCKETS; ++i) {
+            print(" ");
+            print_uint(h[i]);
+        }
+        print_nl();
+    }
+    return 0;
+}
+
+void print_tmo(uint16_t t)
+{
+    // - Timer 0 value as ms
+    print_ulong(((uint32_t)(uint16_t)~t * 16 + 749) / 750);
+}
+
+uint8_t cmd_auto_tmo(char **args)
+{
+    // - Learned reply timeouts
+    //   ++auto_tmo              addresses using them, "pad: ms" or "pad: -"
+    //                           while still learning
+    //   ++auto_tmo pad on|off
+    //   ++auto_tmo min|max [ms] bounds
+    uint8_t pad;
+    uint16_t t;
+    if(!args[0]) {
+        for(pad = 0; pad <= 30; ++pad) {
+            if(!((config.auto_tmo >> pad) & 1)) continue;
+            print_uint(pad);
+            print(": ");
+            if((t = lat_timeout(pad))) print_tmo(t); else print("-");
+            print_nl();
+        }
+    } else if(!strcmp(args[0], "min") || !strcmp(args[0], "max")) {
+        uint16_t *ms = args[0][1] == 'i' ? &config.auto_tmo_min : &config.auto_tmo_max;
+        if(!args[1]) {
+            print_uint(*ms);
+            print_nl();
+            return 0;
+        }
+        *ms = (uint16_t)atoi(args[1]);
+        update_timers();
+    } else {
+        pad = (uint8_t)atoi(args[0]);
+        if(pad > 30 || !args[1]) return 1;
+        if(option(args[1], option_on_off))
+            config.auto_tmo |= 1UL << pad;
+        else
+            config.auto_tmo &= ~(1UL << pad);
+    }
+    return 0;
+}
+
+uint8_t cmd_findlstn(char **args)
+{
+    // - List listeners present, ++findlstn 1 also probes secondary
+    //   addresses of primaries with no listener, listed as pad:sad
+    //   Stops with "err" if the bus doesn't take the address commands
+    if(!config.mode) return 1;
+    uint8_t sad = args[0] && atoi(args[0]);
+    uint8_t cmd[3] = { UNL, LAD, SAD };
+    uint8_t pad, s, r, n = 0;
+    for(pad = 0; pad <= 30; ++pad) {
+        cmd[1] = LAD + pad;
+        if((r = gpib_probe(cmd, 2)) == 1) {
+            if(n++) print(" ");
+            print_uint(pad);
+        } else if(r) {
+            goto fail;
+        } else if(sad) {
+            for(s = 0; s <= 30; ++s) {
+                cmd[2] = SAD + s;
+                if((r = gpib_probe(cmd, 3)) == 1) {
+                    if(n++) print(" ");
+                    print_uint(pad);
+                    print(":");
+                    print_uint(SAD + s);
+                } else if(r) {
+                    goto fail;
+                }
+            }
+        }
+    }
+    cmd[0] = UNL;
+    gpib_tx(cmd, 1, GPIB_CMD);
+    print_nl();
+    return 0;
+    
+fail:
+    if(n) print(" ");
+    print("err");
+    print_nl();
+    return 1;
+}
+
+uint8_t cmd_fanout(char **args)
+{
+    // - Send one query to several devices, read each reply in turn
+    //   ++fanout pad[:sad] ... query, sad 96 to 126 as for ++addr
+    //   Each reply is sent as ++read sends it, after a "pad: " tag
+    //   A device that fails gets "err n" after the tag and whatever it
+    //   sent, n = 1 for a timeout
+    //   Tag, reply and error go out as one reply, so with ++compress
+    //   each device is one frame. Not with ++pack, a tag isn't a number.
+    if(!config.mode || config.pack) return 1;
+    uint8_t addr = config.addr, sad = config.sad, ar = config.auto_read;
+    uint8_t e, err = 0;
+    char **a, *q, *c;
+    for(a = args; *a && **a >= '0' && **a <= '9'; ++a)
+        if(addr_parse(*a, &e, &e)) return 1;
+    if(!*a || a == args) return 1;
+    q = *a;
+    while(a[1]) ++a;
+    for(c = q; c < *a; ++c)     // Rejoin the words of the query
+        if(!*c) *c = ' ';
+    
+    config.auto_read = 0;
+    for(a = args; *a != q && !uart.abort; ++a) {
+        addr_parse(*a, &config.addr, &config.sad);
+        rx_print(*a);
+        rx_print(": ");
+        e = write_data(q, (uint8_t)strlen(q), 0);
+        if(!e) e = gpib_read();
+        if(e) {
+            rx_print("err ");
+            rx_put('0' + e);
+            rx_print("\r\n");
+            err = 1;
+        }
+        gpib_rx_end();
+    }
+    config.addr = addr;
+    config.sad = sad;
+    config.auto_read = ar;
+    return err;
+}
+
 uint8_t cmd_spoll(char **args)
 {
-    static uint8_t spe[] = { SPE, TAD };
+    if(!config.mode) return 1;
+    static uint8_t spe[] = { SPE, TAD, SAD };
     static uint8_t spd[] = { SPD };
     
     spe[1] = TAD + config.addr;
-    gpib_tx(spe, sizeof(spe), 1);
+    spe[2] = config.sad;
+    gpib_tx(spe, config.sad ? 3 : 2, 1);
     gpib_rx1();
     gpib_tx(spd, sizeof(spd), 1);
     return 0;
@@ -790,10 +2449,69 @@ uint8_t cmd_srq(char **args)
     return 0;
 }
 
+uint8_t cmd_srq_auto(char **args)
+{
+    if(args[0]) {
+        config.srq_auto = option(args[0], option_on_off);
+    } else {
+        print_uint(config.srq_auto);
+        print_nl();
+    }
+    return 0;
+}
+
+uint8_t cmd_cache(char **args)
+{
+    // - Response cache
+    //   ++cache 1 | 0
+    //   ++cache flush
+    //   ++cache query [q ...]     queries to keep, *IDN? *OPT? at start
+    char *q = cache.queries;
+    uint8_t i, l;
+    if(!args[0]) {
+        print_uint(cache.on);
+        print_nl();
+    } else if(!strcmp(args[0], "flush")) {
+        cache_flush();
+    } else if(!strcmp(args[0], "query")) {
+        if(!args[1]) {
+            for(; *q; q += strlen(q) + 1) {
+                if(q != cache.queries) print(" ");
+                print(q);
+            }
+            print_nl();
+            return 0;
+        }
+        cache_flush();
+        for(i = 1; args[i]; ++i) {
+            l = (uint8_t)strlen(args[i]) + 1;
+            if(q + l >= cache.queries + sizeof(cache.queries)) break;
+            memcpy(q, args[i], l);
+            q += l;
+        }
+        *q = 0;
+        return args[i] ? 1 : 0;
+    } else {
+        cache.on = option(args[0], option_on_off);
+        cache_flush();
+    }
+    return 0;
+}
+
+uint8_t cmd_data_err(char **args)
+{
+    // - Fails when the last data line sent outside a batch didn't get
+    //   to the bus, so a host can check a long write
+    uint8_t e = line.err;
+    line.err = GPIB_OK;
+    return e;
+}
+
 uint8_t cmd_status(char **args)
 {
     if(args[0]) {
         config.status = (uint8_t)atoi(args[0]);
+        gpib_device_srq();
     } else {
         print_uint(config.status);
         print_nl();
@@ -803,14 +2521,14 @@ uint8_t cmd_status(char **args)
 
 uint8_t cmd_trg(char **args)
 {
+    if(!config.mode) return 1;
     static uint8_t cmd[] = { UNL, LAD, LAD, LAD, LAD, LAD, LAD, LAD, LAD, LAD, LAD, LAD, LAD, LAD, LAD, LAD, GET };
     
     if(args[0]) {
         /// todo: parse GPIB addresses - up to 15
     } else {
-        cmd[1] = LAD + config.addr;
-        cmd[2] = GET;
-        gpib_tx(cmd, 3, 1);
+        if(gpib_address(0)) return 1;
+        gpib_tx(cmd + sizeof(cmd) - 1, 1, 1);  // GET
     }
     return 0;
 }
@@ -831,6 +2549,7 @@ uint8_t cmd_help(char **args)
 
 uint8_t cmd_tek_read_mem(char **args)
 {
+    if(!config.mode) return 1;
     uint32_t a = 0;
     uint32_t l = 256;
     uint16_t k = 1024;
@@ -864,6 +2583,7 @@ uint8_t cmd_tek_read_mem(char **args)
         gpib_tx(talk_addr, sizeof(talk_addr), 1);
         gpib_rx_buf(r, sizeof(r));
         gpib_rx();
+        gpib_rx_end();
         gpib_tx(lsn_addr, sizeof(lsn_addr), 1);
         gpib_tx((uint8_t*)"+", 1, 0);
     }
@@ -884,12 +2604,22 @@ CMDS commands[] = {
     "debug",        cmd_debug,          0,
     "bps",          cmd_bps,            0,
     "baud",         cmd_bps,            0,
+    "bps_test",     cmd_bps_test,       0,
     "echo",         cmd_echo,           0,
+    "flow",         cmd_flow,           0,
+    "pack",         cmd_pack,           0,
+    "compress",     cmd_compress,       0,
     "listen_tmo",   cmd_listen_timeout, 0,
     "talk_tmo",     cmd_talk_timeout,   0,
     "spoll_tmo",    cmd_spoll_timeout,  0,
     "write_hex",    cmd_write_hex,      0,
     "tek_read_mem", cmd_tek_read_mem,   0,
+    "findlstn",     cmd_findlstn,       0,
+    "latency",      cmd_latency,        0,
+    "fanout",       cmd_fanout,         0,
+    "cache",        cmd_cache,          0,
+    "auto_tmo",     cmd_auto_tmo,       0,
+    "data_err",     cmd_data_err,       0,
     // Prologix commands
     "addr",         cmd_addr,           0,
     "auto",         cmd_auto,           0,
@@ -902,13 +2632,14 @@ CMDS commands[] = {
     "llo",          cmd_llo,            0,
     "loc",          cmd_loc,            0,
     "lon",          cmd_unsupported,    0,
-    "mode",         cmd_unsupported,    0,
+    "mode",         cmd_mode,           0,
     "read",         cmd_read,           0,
     "read_tmo_ms",  cmd_listen_timeout, 0,
     "rst",          cmd_reset,          0,
     "savecfg",      cmd_unsupported,    0,
     "spoll",        cmd_spoll,          0,
     "srq",          cmd_srq,            0,
+    "srq_auto",     cmd_srq_auto,       0,
     "status",       cmd_status,         0,
     "trg",          cmd_trg,            0,  /// todo: support for multiple addresses
     "ver",          cmd_ver,            0,
@@ -917,6 +2648,160 @@ CMDS commands[] = {
     0,              0,                  0
 };
 
+void task_idle(void)
+{
+    // - Back to listening between lines, a talking controller
+    //   can't see SRQ
+    if(config.mode && !line.more) gpib_role(ROLE_LISTEN);
+    uart_xoff();
+    line_task();
+    srq_task();
+    bps_task();
+    if(srq.report) {
+        srq.report = 0;
+        print("SRQ");
+        print_nl();
+    }
+    if(!config.mode) gpib_device_task();
+}
+
+uint8_t command(char *s)
+{
+    char c;
+    char *ap = s;
+    char *args[32];
+    char **a = args;
+    while((c = *ap)) {
+        if(c == ' ') {
+            *ap++ = 0;
+            while(*ap == ' ') ++ap;
+            if(*ap) *a++ = ap;
+        } else {
+            ++ap;
+        }
+    }
+    *a = 0;
+    if(config.debug & 1) print_args(args);
+
+    CMDS *cmd = commands;
+    do {
+        if(!strcmp(cmd->name, s))
+            return cmd->function(args);
+        ++cmd;
+    } while(cmd->name);
+    return 1;
+}
+
+char const eos_str[4][3] = { "\r\n", "\r", "\n", "" };
+
+uint8_t scpi_read(uint8_t n)
+{
+    // - Read replies until there is an answer for each of n queries
+    //   Every read has to bring at least one, so at most n reads
+    uint8_t err = GPIB_OK, i;
+    scpi_start(&scpi_rx, 1);
+    scpi_rx.on = 1;
+    for(i = 0; i < n && scpi_rx.units < n && !err; ++i) {
+        err = cmd_read(0);
+        scpi_unit(&scpi_rx);
+    }
+    scpi_rx.on = 0;
+    return err;
+}
+
+uint8_t write_data(char *b, uint8_t l, uint8_t more)
+{
+    static uint8_t stream = 0;  // Earlier parts of the message already sent
+    uint8_t err = GPIB_OK, i, want = 0, hit = 0;
+    char const *e = eos_str[config.eos < 3 ? config.eos : 3];
+    uint8_t n = more ? 0 : (uint8_t)strlen(e);
+    
+    if(!config.mode) {      // - Device: hold until addressed to talk
+        if(!stream) {
+            if(device.xf == DX_TALK) gpib_device_cancel();
+            device.len = 0;
+        }
+        err = gpib_device_put((uint8_t *)b, l);
+        if(!err) err = gpib_device_put((uint8_t const *)e, n);
+        stream = more && !err;
+        return err;
+    }
+    if(!stream) {
+        if(!l && !n) return 0;
+        want = !more && cache_wanted(b, l);
+        if(want) hit = cache_find(b, l);
+        if(!hit) err = gpib_address(0);
+        scpi_start(&scpi_tx, 0);
+    }
+    if(config.auto_read == 2)
+        for(i = 0; i < l; ++i) scpi_scan(&scpi_tx, b[i]);
+    stream = more;
+    if(err) return err;
+    if(more)
+        return l ? gpib_tx((uint8_t *)b, l, GPIB_MORE) : GPIB_OK;
+    if(hit) {
+        cache.hit = hit;        // The device already answered this
+    } else if(n) {
+        if(l) err = gpib_tx((uint8_t *)b, l, GPIB_MORE);
+        if(!err) err = gpib_tx((uint8_t const *)e, n, GPIB_DATA);
+    } else if(l) {
+        err = gpib_tx((uint8_t *)b, l, GPIB_DATA);
+    }
+    if(err) return err;
+    if(want && !hit) cache_start(b, l);
+
+    if(config.auto_read == 1)
+        return cmd_read(0);
+    if(config.auto_read == 2) {
+        scpi_unit(&scpi_tx);
+        return scpi_read(scpi_tx.units);
+    }
+    return 0;
+}
+
+void batch(char *s)
+{
+    // - Execute ';' separated segments of one line back to back
+    //   ++cmd args;data;++cmd args;...
+    //   A data segment runs up to the next ";+" so SCPI compound
+    //   messages can be sent as one segment, as does ++fanout for the
+    //   query at its end
+    uint8_t n = 0;
+    uint32_t err = 0;
+    uint8_t cmd = 1;
+    char *e, last;
+    for(;;) {
+        e = s;
+        if(cmd && strncmp(s, "fanout ", 7))
+            while(*e && *e != ';') ++e;
+        else
+            while(*e && !(*e == ';' && e[1] == '+')) ++e;
+        last = *e;
+        *e = 0;
+        if(e != s) {
+            ++n;
+            if(cmd ? command(s) : write_data(s, (uint8_t)(e - s), 0))
+                if(n <= 32) err |= 1UL << (n - 1);
+        }
+        if(!last) break;
+        s = e + 1;
+        cmd = 0;
+        while(*s == '+') ++s, cmd = 1;
+    }
+    if(err) {
+        print("err");
+        for(n = 1; err; ++n, err >>= 1) {
+            if(err & 1) {
+                print(" ");
+                print_uint(n);
+            }
+        }
+    } else {
+        print("ok");
+    }
+    print_nl();
+}
+
 void main(void) {
     ANSELA = 0x00;
     LATA   = 0x3F;
@@ -928,7 +2813,7 @@ void main(void) {
     
     ANSELC = 0x00;
     LATC   = 0x40;
-    TRISC  = 0xB0;
+    TRISC  = 0xB2;
     
     ANSELD = 0x00;
     LATD   = 0x00;
@@ -939,13 +2824,22 @@ void main(void) {
     TRISE  = 0x03;
 
     update_brg();
+    brg_safe = config.brg;
     BAUDCON1 = 0;
     BAUDCON1bits.BRG16 = 1;
     TXSTA1 = 0;
+    TXSTA1bits.BRGH = 1;
     TXSTA1bits.TXEN = 1;
     RCSTA1 = 0;
     RCSTA1bits.CREN = 1;
     RCSTA1bits.SPEN = 1;
+    RCONbits.IPEN = 1;      // Two interrupt priorities
+    INTCON2bits.IOCIP = 1;  // ATN change high
+    IPR1bits.RCIP = 0;      // Host rx and timer 1 low
+    IPR1bits.TMR1IP = 0;
+    PIE1bits.RCIE = 1;      // Host rx is buffered by the interrupt
+    INTCONbits.GIEL = 1;
+    INTCONbits.GIEH = 1;
 
     update_timers();
     INTCONbits.INT0IE = 0;
@@ -953,6 +2847,13 @@ void main(void) {
     T0CONbits.T0PS = 7;
     T0CONbits.TMR0ON = 1;
 
+    T1CON = 0;
+    T1CONbits.T1CKPS = 3;   // 12 MHz / 8
+    T1CONbits.RD16 = 1;     // Reading TMR1L latches TMR1H
+    PIR1bits.TMR1IF = 0;
+    PIE1bits.TMR1IE = 1;    // Count overflows
+    T1CONbits.TMR1ON = 1;
+
     LATDbits.LD3 = 0;   // PE Pullup enable
     LATDbits.LD4 = 0;   // TE Talk enable
     LATDbits.LD5 = 0;   // DC Direction control
@@ -973,109 +2874,43 @@ void main(void) {
     
     LATAbits.LA0 = 0;   // Assert REN
     
-    gpib_listen();
+    gpib_role(ROLE_LISTEN);
     
     uint8_t dcl[] = { DCL };
     //gpib_tx(dcl, sizeof(DCL), 1);
    
-    char *end = 0;
     for(;;) {
-        char c, *cp, esc, rxbuf[256];
-        esc = 0;
-        cp = rxbuf;
-        uint8_t eol = 0;
-        do {
-            /// todo: check for and clear UART rx errors
-            while(!PIR1bits.RCIF);
-            c = RCREG1;
-            if(c < 32 && !esc) {
-                switch(c) {
-                    case 10:    // LF
-                    case 13:    // CR
-                        eol = 1;
-                        break;
-                    case 27:    // ESC
-                        esc = c;
-                        break;
-                    case 8:     // BS
-                        if(cp > rxbuf) {
-                            --cp;
-                            if(config.echo) {
-                                //TXREG1 = c;
-                                //while(!PIR1bits.TXIF);
-                                //TXREG1 = 0x7F;
-                                print("\x8 \x8");
-                            }
-                        }
-                        break;
-                    case 11:    // VT (ctrl-k, recall previous command line)
-                        while(cp < end) {
-                            if(!*cp) *cp = ' ';
-                            TXREG1 = *cp++;
-                            while(!PIR1bits.TXIF);
-                        }
-                        break;
-                }
+        task_idle();
+        if(line.state != LINE_EDIT) lat.pad = 0;    // Not timed from here
+        if(line.state == LINE_FULL) {
+            if(!line.more) uart.abort = line.err = 0;
+            uint8_t e = write_data(line.buf, line.n, 1);    // Stream long data to the bus
+            if(!line.err) line.err = e;
+            line.more = 1;
+            line.n = 0;
+            line.state = LINE_EDIT;
+            line_resume();
+        } else if(line.state == LINE_DONE) {
+            if(!line.more) uart.abort = 0;
+            char *pp = line.buf, plus = 0;
+            while(*pp == '+' && !line.lit) ++pp, ++plus;
+            
+            if(plus && !line.more) {
+                if(line.over) {
+                    print("err");   // None of a cut line is run
+                    print_nl();
+                } else if(strchr(pp, ';'))
+                    batch(pp);
+                else
+                    command(pp);
             } else {
-                if(esc) {
-                    esc = 0;
-                    c &= 0x1F;
-                }
-                *cp++ = c;
-                if(config.echo) TXREG1 = c;  // echo
-            }
-        } while(!eol);
-        end = cp;
-        if(config.echo) print("\r\n");
-
-        char *pp = rxbuf, plus = 0;
-        while(*pp == '+') ++pp, ++plus;
-        
-        if(plus) {
-            *cp = 0;
-            char *ap = pp;
-            char *args[32];
-            char **a = args;
-            while((c = *ap)) {
-                if(c == ' ') {
-                    *ap++ = 0;
-                    while(*ap == ' ') ++ap;
-                    if(*ap) *a++ = ap;
-                } else {
-                    ++ap;
-                }
-            }
-            *a = 0;
-            if(config.debug & 1) print_args(args);
-
-            CMDS *cmd = commands;
-            do {
-                if(!strcmp(cmd->name, (char *)pp)) {
-                    cmd->function(args);
-                    break;
-                }
-                ++cmd;
-            } while(cmd->name);
-        } else {
-            switch(config.eos) {
-                case 0: *cp++ = '\r'; *cp++ = '\n'; break;
-                case 1: *cp++ = '\r'; break;
-                case 2: *cp++ = '\n'; break;
-            }
-            if(cp != rxbuf) {
-                static uint8_t lsn_addr[] = { UNT, UNL, LAD };
-                lsn_addr[2] = LAD + config.addr;
-                gpib_tx(lsn_addr, sizeof(lsn_addr), 1);
-                gpib_tx((uint8_t *)rxbuf, cp - rxbuf, 0);
-
-                if(config.auto_read == 1) {
-                    cmd_read(0);
-                } else if(config.auto_read == 2) {
-                    cp = rxbuf;
-                    while(*cp > 32) ++cp;
-                    if(*--cp == '?') cmd_read(0);
-                }
+                uint8_t e = write_data(line.buf, line.n, 0);
+                if(!line.more || !line.err) line.err = e;
             }
+            line.end = line.more ? 0 : line.n;
+            line.n = line.lit = line.more = line.over = 0;
+            line.state = LINE_EDIT;
+            line_resume();
         }
     }
     